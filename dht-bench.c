@@ -0,0 +1,785 @@
+/* Micro-benchmarks for the DHT library.  Run "make bench", or
+   "./dht-bench parse" and so on for a single one.
+
+   This includes dht.c rather than linking with it, so that it can time
+   the internal functions directly. */
+
+#include "dht.c"
+
+#include <time.h>
+
+/* The last message sent, see bench_encode. */
+static unsigned char sent_buf[2048];
+static int sent_len, sent_flags;
+
+int
+dht_sendto(int sockfd, const void *buf, int len, int flags,
+           const struct sockaddr *to, int tolen)
+{
+    memcpy(sent_buf, buf, MIN(len, sizeof(sent_buf)));
+    sent_len = len;
+    sent_flags = flags;
+    return len;
+}
+
+int
+dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+void
+dht_hash(void *hash_return, int hash_size,
+         const void *v1, int len1,
+         const void *v2, int len2,
+         const void *v3, int len3)
+{
+    memset(hash_return, 0, hash_size);
+    memcpy(hash_return, v1, MIN(len1, hash_size));
+}
+
+int
+dht_random_bytes(void *buf, size_t size)
+{
+    size_t i;
+    for(i = 0; i < size; i++)
+        ((unsigned char*)buf)[i] = random();
+    return size;
+}
+
+static double
+elapsed(const struct timespec *t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void
+random_id(unsigned char *id)
+{
+    dht_random_bytes(id, 20);
+}
+
+/* A KRPC message corpus, in the proportions seen by a busy node: mostly
+   queries and replies to get_peers and find_node. */
+
+#define CORPUS_SIZE 64
+
+static unsigned char corpus[CORPUS_SIZE][1500];
+static int corpus_len[CORPUS_SIZE];
+
+static int
+put(unsigned char *buf, int i, const char *s)
+{
+    int len = strlen(s);
+    memcpy(buf + i, s, len);
+    return i + len;
+}
+
+static int
+put_string(unsigned char *buf, int i, const unsigned char *s, int len)
+{
+    i += sprintf((char*)buf + i, "%d:", len);
+    memcpy(buf + i, s, len);
+    return i + len;
+}
+
+static int
+put_random(unsigned char *buf, int i, int len)
+{
+    unsigned char s[1024];
+    dht_random_bytes(s, len);
+    return put_string(buf, i, s, len);
+}
+
+static int
+make_message(unsigned char *buf, int kind)
+{
+    int i = 0, j;
+
+    switch(kind) {
+    case 0:                     /* ping */
+        i = put(buf, i, "d1:ad2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "e1:q4:ping1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:v4:UT\x01\x02");
+        i = put(buf, i, "1:y1:qe");
+        break;
+    case 1:                     /* find_node */
+        i = put(buf, i, "d1:ad2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "6:target");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "4:wantl2:n42:n6ee1:q9:find_node1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:qe");
+        break;
+    case 2:                     /* get_peers */
+        i = put(buf, i, "d1:ad2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "9:info_hash");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "e1:q9:get_peers1:t");
+        i = put_random(buf, i, 2);
+        i = put(buf, i, "1:v4:LT\x01\x02");
+        i = put(buf, i, "1:y1:qe");
+        break;
+    case 3:                     /* announce_peer */
+        i = put(buf, i, "d1:ad2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "12:implied_porti1e9:info_hash");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "4:porti6881e5:token");
+        i = put_random(buf, i, 8);
+        i = put(buf, i, "e1:q13:announce_peer1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:qe");
+        break;
+    case 4:                     /* pong */
+        i = put(buf, i, "d1:rd2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "e1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:re");
+        break;
+    case 5:                     /* nodes */
+        i = put(buf, i, "d1:rd2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "5:nodes");
+        i = put_random(buf, i, 8 * 26);
+        i = put(buf, i, "e1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:re");
+        break;
+    case 6:                     /* nodes and nodes6 */
+        i = put(buf, i, "d1:rd2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "5:nodes");
+        i = put_random(buf, i, 8 * 26);
+        i = put(buf, i, "6:nodes6");
+        i = put_random(buf, i, 8 * 38);
+        i = put(buf, i, "5:token");
+        i = put_random(buf, i, 8);
+        i = put(buf, i, "e1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:re");
+        break;
+    case 7:                     /* values */
+        i = put(buf, i, "d1:rd2:id");
+        i = put_random(buf, i, 20);
+        i = put(buf, i, "5:token");
+        i = put_random(buf, i, 8);
+        i = put(buf, i, "6:valuesl");
+        for(j = 0; j < 50; j++)
+            i = put_random(buf, i, 6);
+        i = put(buf, i, "ee1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:re");
+        break;
+    default:                    /* error */
+        i = put(buf, i, "d1:eli201e23:A Generic Error Ocurrede1:t");
+        i = put_random(buf, i, 4);
+        i = put(buf, i, "1:y1:ee");
+        break;
+    }
+    buf[i] = '\0';
+    return i;
+}
+
+static void
+bench_parse(void)
+{
+    static const int mix[10] = {2, 2, 5, 5, 6, 7, 1, 0, 4, 8};
+    struct parsed_message m;
+    struct timespec t0;
+    long n = 0, bytes = 0, round, rounds = 20000;
+    int i, messages = 0;
+    double t;
+
+    for(i = 0; i < CORPUS_SIZE; i++)
+        corpus_len[i] = make_message(corpus[i], mix[i % 10]);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(round = 0; round < rounds; round++) {
+        for(i = 0; i < CORPUS_SIZE; i++) {
+            memset(&m, 0, sizeof(m));
+            if(parse_message(corpus[i], corpus_len[i], &m) >= 0)
+                messages++;
+            bytes += corpus_len[i];
+            n++;
+        }
+    }
+    t = elapsed(&t0);
+
+    printf("parse: %ld messages (%d parsed), %.1f ns per message, "
+           "%.0f MB/s\n",
+           n, messages, t * 1e9 / n, bytes / t / 1e6);
+}
+
+/* The encoders as they were before the templates of make_templates,
+   for comparison. */
+
+static unsigned char ref_v[9];
+static int ref_have_v;
+
+#define CHECK(offset, delta, size)                      \
+    if(delta < 0 || offset + delta > size) goto fail
+
+#define INC(offset, delta, size)                        \
+    CHECK(offset, delta, size);                         \
+    offset += delta
+
+#define COPY(buf, offset, src, delta, size)             \
+    CHECK(offset, delta, size);                         \
+    memcpy(buf + offset, src, delta);                   \
+    offset += delta;
+
+#define ADD_V(buf, offset, size)                        \
+    if(ref_have_v) {                                    \
+        COPY(buf, offset, ref_v, sizeof(ref_v), size);  \
+    }
+
+static int
+ref_send_ping(const struct address *a,
+              const unsigned char *tid, int tid_len)
+{
+    char buf[512];
+    int i = 0, rc;
+    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
+    COPY(buf, i, myid, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "e1:q4:ping1:t%d:", tid_len);
+    INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+    return dht_send(buf, i, 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+ref_send_pong(const struct address *a,
+              const unsigned char *tid, int tid_len)
+{
+    char buf[512];
+    int i = 0, rc;
+    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
+    COPY(buf, i, myid, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
+    return dht_send(buf, i, 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+ref_send_find_node(const struct address *a,
+                   const unsigned char *tid, int tid_len,
+                   const unsigned char *target, int want, int confirm)
+{
+    char buf[512];
+    int i = 0, rc;
+    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
+    COPY(buf, i, myid, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "6:target20:"); INC(i, rc, 512);
+    COPY(buf, i, target, 20, 512);
+    if(want > 0) {
+        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
+                      (want & WANT4) ? "2:n4" : "",
+                      (want & WANT6) ? "2:n6" : "");
+        INC(i, rc, 512);
+    }
+    rc = snprintf(buf + i, 512 - i, "e1:q9:find_node1:t%d:", tid_len);
+    INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+/* The peers are passed as addresses rather than as a storage, whose
+   layout has changed since. */
+static int
+ref_send_nodes_peers(const struct address *a,
+                     const unsigned char *tid, int tid_len,
+                     const unsigned char *nodes, int nodes_len,
+                     const unsigned char *nodes6, int nodes6_len,
+                     int af, const struct address *peers, int numpeers,
+                     const unsigned char *token, int token_len)
+{
+    char buf[2048];
+    int i = 0, rc, j0, j, k, len;
+
+    rc = snprintf(buf + i, 2048 - i, "d1:rd2:id20:"); INC(i, rc, 2048);
+    COPY(buf, i, myid, 20, 2048);
+    if(nodes_len > 0) {
+        rc = snprintf(buf + i, 2048 - i, "5:nodes%d:", nodes_len);
+        INC(i, rc, 2048);
+        COPY(buf, i, nodes, nodes_len, 2048);
+    }
+    if(nodes6_len > 0) {
+         rc = snprintf(buf + i, 2048 - i, "6:nodes6%d:", nodes6_len);
+         INC(i, rc, 2048);
+         COPY(buf, i, nodes6, nodes6_len, 2048);
+    }
+    if(token_len > 0) {
+        rc = snprintf(buf + i, 2048 - i, "5:token%d:", token_len);
+        INC(i, rc, 2048);
+        COPY(buf, i, token, token_len, 2048);
+    }
+
+    if(numpeers > 0) {
+        len = af == AF_INET ? 4 : 16;
+        j0 = random() % numpeers;
+        j = j0;
+        k = 0;
+
+        rc = snprintf(buf + i, 2048 - i, "6:valuesl"); INC(i, rc, 2048);
+        do {
+            rc = snprintf(buf + i, 2048 - i, "%d:", len + 2);
+            INC(i, rc, 2048);
+            COPY(buf, i, peers[j].ip, len, 2048);
+            COPY(buf, i, &peers[j].port, 2, 2048);
+            k++;
+            j = (j + 1) % numpeers;
+        } while(j != j0 && k < 50);
+        rc = snprintf(buf + i, 2048 - i, "e"); INC(i, rc, 2048);
+    }
+
+    rc = snprintf(buf + i, 2048 - i, "e1:t%d:", tid_len); INC(i, rc, 2048);
+    COPY(buf, i, tid, tid_len, 2048);
+    ADD_V(buf, i, 2048);
+    rc = snprintf(buf + i, 2048 - i, "1:y1:re"); INC(i, rc, 2048);
+
+    return dht_send(buf, i, 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+ref_send_get_peers(const struct address *a,
+                   unsigned char *tid, int tid_len, unsigned char *infohash,
+                   int want, int confirm)
+{
+    char buf[512];
+    int i = 0, rc;
+
+    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
+    COPY(buf, i, myid, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, infohash, 20, 512);
+    if(want > 0) {
+        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
+                      (want & WANT4) ? "2:n4" : "",
+                      (want & WANT6) ? "2:n6" : "");
+        INC(i, rc, 512);
+    }
+    rc = snprintf(buf + i, 512 - i, "e1:q9:get_peers1:t%d:", tid_len);
+    INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+ref_send_announce_peer(const struct address *a,
+                       unsigned char *tid, int tid_len,
+                       unsigned char *infohash, unsigned short port,
+                       unsigned char *token, int token_len, int confirm)
+{
+    char buf[512];
+    int i = 0, rc;
+
+    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
+    COPY(buf, i, myid, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, infohash, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "4:porti%ue5:token%d:", (unsigned)port,
+                  token_len);
+    INC(i, rc, 512);
+    COPY(buf, i, token, token_len, 512);
+    rc = snprintf(buf + i, 512 - i, "e1:q13:announce_peer1:t%d:", tid_len);
+    INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
+
+    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+ref_send_peer_announced(const struct address *a,
+                        unsigned char *tid, int tid_len)
+{
+    char buf[512];
+    int i = 0, rc;
+
+    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
+    COPY(buf, i, myid, 20, 512);
+    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
+    INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
+    return dht_send(buf, i, 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+static int
+ref_send_error(const struct address *a,
+               unsigned char *tid, int tid_len,
+               int code, const char *message)
+{
+    char buf[512];
+    int i = 0, rc, message_len;
+
+    message_len = strlen(message);
+    rc = snprintf(buf + i, 512 - i, "d1:eli%de%d:", code, message_len);
+    INC(i, rc, 512);
+    COPY(buf, i, message, message_len, 512);
+    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
+    COPY(buf, i, tid, tid_len, 512);
+    ADD_V(buf, i, 512);
+    rc = snprintf(buf + i, 512 - i, "1:y1:ee"); INC(i, rc, 512);
+    return dht_send(buf, i, 0, a);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+#undef CHECK
+#undef INC
+#undef COPY
+#undef ADD_V
+
+/* Each message type, and its variants, in both encodings: send_message
+   uses the reference encoders if ref is set.  The argument selects the
+   variant, and successive values cover all of them. */
+
+#define MESSAGE_TYPES 9
+
+static const char *message_names[MESSAGE_TYPES] = {
+    "ping", "pong", "find_node", "nodes", "nodes_peers", "get_peers",
+    "announce_peer", "peer_announced", "error"
+};
+
+static struct address bench_peers[60], bench_peers6[60];
+static unsigned char bench_nodes[8 * 26], bench_nodes6[8 * 38];
+static unsigned char bench_id[20];
+static struct storage *bench_storage;
+static int comparing;
+
+static int
+send_message(int type, int ref, int variant, const struct address *a)
+{
+    unsigned char tid[4] = {'g', 'p', variant, variant >> 8};
+    unsigned char token[40];
+    int tid_len = 1 + variant % 4, token_len = 1 + variant % 39;
+    int want = variant % 4, confirm = variant % 2;
+    int af = variant % 2 ? AF_INET6 : AF_INET;
+    int numpeers = variant % 61;
+    static const unsigned short ports[4] = {1, 6881, 51413, 65535};
+    static const char *messages[3] = {
+        "Generic error", "Announce_peer with forbidden port number",
+        "Get_peers with no info_hash"
+    };
+    int rc;
+
+    memset(token, variant, sizeof(token));
+
+    switch(type) {
+    case 0:
+        return ref ? ref_send_ping(a, tid, tid_len) :
+            send_ping(a, tid, tid_len);
+    case 1:
+        return ref ? ref_send_pong(a, tid, tid_len) :
+            send_pong(a, tid, tid_len);
+    case 2:
+        return ref ? ref_send_find_node(a, tid, tid_len, bench_id,
+                                        want, confirm) :
+            send_find_node(a, tid, tid_len, bench_id, want, confirm);
+    case 3:
+        return ref ?
+            ref_send_nodes_peers(a, tid, tid_len,
+                                 bench_nodes, (variant % 9) * 26,
+                                 bench_nodes6, (variant / 9 % 9) * 38,
+                                 AF_INET, NULL, 0, token, token_len % 21) :
+            send_nodes_peers(a, tid, tid_len,
+                             bench_nodes, (variant % 9) * 26,
+                             bench_nodes6, (variant / 9 % 9) * 38,
+                             AF_INET, NULL, token, token_len % 21);
+    case 4: {
+        /* A storage with the first numpeers peers, served from the same
+           random position by both. */
+        struct storage *st;
+        int i;
+        if(numpeers == 0)
+            numpeers = 1;
+        if(bench_storage == NULL || bench_storage->peers.numpeers != numpeers) {
+            /* Searching for an id that isn't stored creates nothing. */
+            for(i = 0; i < numstorage; i++) {
+                free_peers(&storage[i].peers);
+                free_peers(&storage[i].peers6);
+            }
+            numstorage = 0;
+            memset(storage_index, 0xFF, storage_index_size * sizeof(int));
+            for(i = 0; i < numpeers; i++) {
+                storage_store(bench_id, &bench_peers[i],
+                              ntohs(bench_peers[i].port));
+                storage_store(bench_id, &bench_peers6[i],
+                              ntohs(bench_peers6[i].port));
+            }
+            bench_storage = find_storage(bench_id);
+        }
+        st = bench_storage;
+        if(comparing)
+            srandom(variant);
+        if(ref)
+            rc = ref_send_nodes_peers(a, tid, tid_len, NULL, 0, NULL, 0, af,
+                                      af == AF_INET ?
+                                      bench_peers : bench_peers6,
+                                      numpeers, token, 8);
+        else
+            rc = send_nodes_peers(a, tid, tid_len, NULL, 0, NULL, 0, af,
+                                  st, token, 8);
+        return rc;
+    }
+    case 5:
+        return ref ? ref_send_get_peers(a, tid, tid_len, bench_id,
+                                        want, confirm) :
+            send_get_peers(a, tid, tid_len, bench_id, want, confirm);
+    case 6:
+        return ref ?
+            ref_send_announce_peer(a, tid, tid_len, bench_id,
+                                   ports[variant % 4], token, token_len,
+                                   confirm) :
+            send_announce_peer(a, tid, tid_len, bench_id,
+                               ports[variant % 4], token, token_len,
+                               confirm);
+    case 7:
+        return ref ? ref_send_peer_announced(a, tid, tid_len) :
+            send_peer_announced(a, tid, tid_len);
+    default:
+        return ref ?
+            ref_send_error(a, tid, tid_len, 201 + variant % 3,
+                           messages[variant % 3]) :
+            send_error(a, tid, tid_len, 201 + variant % 3,
+                       messages[variant % 3]);
+    }
+}
+
+static void
+bench_encode(void)
+{
+    static const unsigned char *versions[2] = {
+        (const unsigned char*)"JC\0\0", NULL
+    };
+    unsigned char buf[2048];
+    struct address a;
+    struct timespec t0;
+    int type, variant, v, len, flags, compared = 0, rounds = 200000;
+    double t, t_ref;
+
+    memset(&a, 0, sizeof(a));
+    a.af = AF_INET;
+    a.ip[0] = 192;
+    a.ip[3] = 1;
+    a.port = htons(6881);
+
+    random_id(bench_id);
+    dht_random_bytes(bench_nodes, sizeof(bench_nodes));
+    dht_random_bytes(bench_nodes6, sizeof(bench_nodes6));
+    for(variant = 0; variant < 60; variant++) {
+        memcpy(&bench_peers[variant], &a, sizeof(a));
+        bench_peers[variant].ip[2] = variant;
+        bench_peers[variant].port = htons(1000 + variant);
+        bench_peers6[variant].af = AF_INET6;
+        bench_peers6[variant].ip[0] = 0x20;
+        bench_peers6[variant].ip[1] = 0x01;
+        bench_peers6[variant].ip[15] = variant;
+        bench_peers6[variant].port = htons(2000 + variant);
+    }
+
+    /* The templates must produce exactly what the old code did. */
+    comparing = 1;
+    for(v = 0; v < 2; v++) {
+        make_templates(versions[v]);
+        ref_have_v = versions[v] != NULL;
+        if(ref_have_v) {
+            memcpy(ref_v, "1:v4:", 5);
+            memcpy(ref_v + 5, versions[v], 4);
+        }
+        for(type = 0; type < MESSAGE_TYPES; type++) {
+            for(variant = 0; variant < 400; variant++) {
+                if(send_message(type, 1, variant, &a) < 0)
+                    abort();
+                memcpy(buf, sent_buf, sent_len);
+                len = sent_len;
+                flags = sent_flags;
+                if(send_message(type, 0, variant, &a) < 0)
+                    abort();
+                if(len != sent_len || flags != sent_flags ||
+                   memcmp(buf, sent_buf, len) != 0) {
+                    fprintf(stderr, "encode: %s (variant %d) differs\n",
+                            message_names[type], variant);
+                    exit(1);
+                }
+                compared++;
+            }
+        }
+    }
+    printf("encode: %d messages identical to the old encoders\n", compared);
+    comparing = 0;
+
+    /* Time a few variants of each; for nodes_peers, 50 peers of either
+       family, so that the storage needn't be rebuilt. */
+    make_templates(versions[0]);
+    ref_have_v = 1;
+    for(type = 0; type < MESSAGE_TYPES; type++) {
+        int mask = type == 4 ? 1 : 7, base = type == 4 ? 50 : 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(variant = 0; variant < rounds; variant++)
+            send_message(type, 1, base + 61 * (variant & mask), &a);
+        t_ref = elapsed(&t0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(variant = 0; variant < rounds; variant++)
+            send_message(type, 0, base + 61 * (variant & mask), &a);
+        t = elapsed(&t0);
+        printf("encode: %-15s %5.2f M/s (snprintf %5.2f M/s)\n",
+               message_names[type], rounds / t / 1e6, rounds / t_ref / 1e6);
+    }
+}
+
+/* new_node with a full routing table: every bucket that may split has,
+   and the others are full of good nodes.  This is what a long-running
+   node sees for every message it receives. */
+
+#define KNOWN_MAX 4096
+
+static struct node *
+bench_new_node(const unsigned char *id, int n, int confirm)
+{
+    struct address a;
+    memset(&a, 0, sizeof(a));
+    a.af = AF_INET;
+    a.ip[0] = 10;
+    a.ip[1] = n >> 16;
+    a.ip[2] = n >> 8;
+    a.ip[3] = n;
+    a.port = htons(6881);
+    return new_node(id, &a, confirm);
+}
+
+static int
+bench_known(const unsigned char *id)
+{
+    struct bucket *b;
+    return find_node(id, AF_INET, &b) != NULL;
+}
+
+static void
+bench_node(void)
+{
+    static unsigned char known[KNOWN_MAX][20];
+    unsigned char id[20];
+    int known_addr[KNOWN_MAX];
+    int i, k, n = 1, numknown = 0, good, dubious, cached, incoming;
+    int rounds = 2000000;
+    struct timespec t0;
+    double t;
+
+    /* Nodes sharing k bits with us, for every k, so that our bucket
+       splits as far as it can. */
+    for(k = 0; k < 40; k++) {
+        for(i = 0; i < 64; i++) {
+            random_id(id);
+            memcpy(id, myid, k / 8);
+            id[k / 8] = (myid[k / 8] & (0xFF00 >> (k % 8))) |
+                ((~myid[k / 8] & (0x80 >> (k % 8)))) |
+                (id[k / 8] & (0xFF >> (k % 8 + 1)));
+            if(bench_new_node(id, n, 2) && bench_known(id) &&
+               numknown < KNOWN_MAX) {
+                memcpy(known[numknown], id, 20);
+                known_addr[numknown] = n;
+                numknown++;
+            }
+            n++;
+        }
+    }
+
+    dht_nodes(AF_INET, &good, &dubious, &cached, &incoming);
+
+    /* Replies from nodes we know. */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < rounds; i++) {
+        k = i % numknown;
+        bench_new_node(known[k], known_addr[k], 2);
+    }
+    t = elapsed(&t0);
+    printf("node: %d good, %d cached; known node %.1f ns, ",
+           good, cached, t * 1e9 / rounds);
+
+    /* Replies from nodes we don't, which land in full buckets. */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < rounds; i++) {
+        memcpy(id, known[i % numknown], 20);
+        id[19] ^= 1 + i / numknown % 255;
+        bench_new_node(id, n + i % 65536, 2);
+    }
+    t = elapsed(&t0);
+    printf("unknown node %.1f ns\n", t * 1e9 / rounds);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned char myid[20];
+    int s, s6, all = argc < 2;
+
+    srandom(1);
+    random_id(myid);
+    /* Nothing is sent, but the routing tables need sockets. */
+    s = socket(PF_INET, SOCK_DGRAM, 0);
+    s6 = socket(PF_INET6, SOCK_DGRAM, 0);
+    if(dht_init(s, s6, myid, (const unsigned char*)"JC\0\0") < 0) {
+        perror("dht_init");
+        return 1;
+    }
+
+    if(all || strcmp(argv[1], "parse") == 0)
+        bench_parse();
+    if(all || strcmp(argv[1], "encode") == 0)
+        bench_encode();
+    if(all || strcmp(argv[1], "node") == 0)
+        bench_node();
+
+    dht_uninit();
+    return 0;
+}
@@ -84,9 +84,13 @@ callback(void *closure,
          const void *data, size_t data_len)
 {
     if(event == DHT_EVENT_SEARCH_DONE)
-        printf("Search done.\n");
+        printf("Search done%s.\n",
+               *(const int*)data == DHT_SEARCH_EXHAUSTED ?
+               " (out of budget)" : "");
     else if(event == DHT_EVENT_SEARCH_DONE6)
-        printf("IPv6 search done.\n");
+        printf("IPv6 search done%s.\n",
+               *(const int*)data == DHT_SEARCH_EXHAUSTED ?
+               " (out of budget)" : "");
     else if(event == DHT_EVENT_VALUES)
         printf("Received %d values.\n", (int)(data_len / 6));
     else if(event == DHT_EVENT_VALUES6)
@@ -121,7 +125,7 @@ main(int argc, char **argv)
     int s = -1, s6 = -1, port;
     int have_id = 0;
     unsigned char myid[20];
-    time_t tosleep = 0;
+    struct timeval tosleep = {0, 0};
     char *id_file = "dht-example.id";
     int opt;
     int quiet = 0, ipv4 = 1, ipv6 = 1;
@@ -361,8 +365,14 @@ main(int argc, char **argv)
     while(1) {
         struct timeval tv;
         fd_set readfds;
-        tv.tv_sec = tosleep;
-        tv.tv_usec = random() % 1000000;
+        /* Be a little late, so as not to wake up in lockstep with
+           other nodes. */
+        tv.tv_sec = tosleep.tv_sec;
+        tv.tv_usec = tosleep.tv_usec + random() % 100000;
+        if(tv.tv_usec >= 1000000) {
+            tv.tv_sec++;
+            tv.tv_usec -= 1000000;
+        }
 
         FD_ZERO(&readfds);
         if(s >= 0)
@@ -406,7 +416,8 @@ main(int argc, char **argv)
                 perror("dht_periodic");
                 if(rc == EINVAL || rc == EFAULT)
                     abort();
-                tosleep = 1;
+                tosleep.tv_sec = 1;
+                tosleep.tv_usec = 0;
             }
         }
 
@@ -0,0 +1,206 @@
+/* Regression tests for the DHT library.  Run "make check".
+
+   Like dht-bench.c, this includes dht.c rather than linking with it, so
+   that it can look at the internal state.  Nothing is sent: with empty
+   routing tables, every search completes as soon as it starts. */
+
+#include "dht.c"
+
+int
+dht_sendto(int sockfd, const void *buf, int len, int flags,
+           const struct sockaddr *to, int tolen)
+{
+    return len;
+}
+
+int
+dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+void
+dht_hash(void *hash_return, int hash_size,
+         const void *v1, int len1,
+         const void *v2, int len2,
+         const void *v3, int len3)
+{
+    memset(hash_return, 0, hash_size);
+    memcpy(hash_return, v1, MIN(len1, hash_size));
+}
+
+int
+dht_random_bytes(void *buf, size_t size)
+{
+    size_t i;
+    for(i = 0; i < size; i++)
+        ((unsigned char*)buf)[i] = random();
+    return size;
+}
+
+static int s = -1, s6 = -1, failures;
+
+static void
+check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if(!ok)
+        failures++;
+}
+
+static void
+init(void)
+{
+    unsigned char myid[20];
+
+    dht_random_bytes(myid, 20);
+    if(dht_init(s, s6, myid, (const unsigned char*)"JC\0\0") < 0) {
+        perror("dht_init");
+        exit(1);
+    }
+    dht_set_parameter(DHT_PARAM_CACHE_TTL, 60000);
+    dht_set_parameter(DHT_PARAM_SEARCH_RATE, 1000);
+}
+
+/* Run dht_periodic until the queued searches have all completed. */
+static void
+run(void)
+{
+    struct timeval tv;
+    int i;
+
+    for(i = 0; i < 1000 && (numpending > 0 || search_heap_size > 0); i++) {
+        dht_periodic(NULL, 0, NULL, 0, &tv, NULL, NULL);
+        usleep(1000);
+    }
+}
+
+/* The targets, and the number of DHT_EVENT_SEARCH_DONE events passed to
+   each closure. */
+static unsigned char ids[8][20];
+static int done[8];
+static void *closures[8];
+/* What the callback does on completion of the search with closure k. */
+static int reenter = -1, uninit = -1;
+
+static void
+callback(void *closure, int event,
+         const unsigned char *info_hash,
+         const void *data, size_t data_len)
+{
+    int k = (int*)closure - done;
+
+    if(event != DHT_EVENT_SEARCH_DONE)
+        return;
+
+    done[k]++;
+    if(k == reenter)
+        check(dht_search_many(ids[3], 2, 0, AF_INET, callback,
+                              closures + 3) == 2,
+              "re-entrant dht_search_many queues its searches");
+    if(k == uninit)
+        dht_uninit();
+}
+
+/* A cached answer delivered by dht_search_many runs the callback, which
+   may queue more searches; neither the searches of the outer call nor
+   those of the inner one may be lost. */
+static void
+test_reenter(void)
+{
+    int i;
+
+    init();
+    memset(done, 0, sizeof(done));
+    dht_search(ids[2], 0, AF_INET, callback, &done[2]);
+    check(done[2] == 1, "search without nodes completes");
+
+    done[2] = 0;
+    reenter = 2;
+    check(dht_search_many(ids[0], 3, 0, AF_INET, callback, closures) == 2,
+          "dht_search_many answers a search from the cache");
+    reenter = -1;
+    check(numpending == 4, "all four misses are queued");
+    run();
+    for(i = 0; i < 5; i++)
+        check(done[i] == 1, "each closure completes once");
+    dht_uninit();
+}
+
+/* Likewise if the callback calls dht_uninit. */
+static void
+test_uninit(void)
+{
+    init();
+    memset(done, 0, sizeof(done));
+    dht_search(ids[6], 0, AF_INET, callback, &done[6]);
+    dht_search(ids[7], 0, AF_INET, callback, &done[7]);
+
+    done[6] = done[7] = 0;
+    uninit = 6;
+    check(dht_search_many(ids[5], 3, 0, AF_INET, callback,
+                          closures + 5) == 1,
+          "dht_search_many survives dht_uninit in the callback");
+    uninit = -1;
+    check(done[6] == 1 && done[7] == 0 && buckets == NULL,
+          "nothing is reported after dht_uninit");
+}
+
+static int
+periodic_sleep(void)
+{
+    struct timeval tv;
+
+    dht_periodic(NULL, 0, NULL, 0, &tv, NULL, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* With announces registered, dht_periodic asks to be called back when
+   the next one is due rather than at the end of every slot. */
+static void
+test_announce_sleep(void)
+{
+    struct announce *a;
+    int t;
+
+    init();
+    dht_announce(ids[0], 6881, AF_INET);
+    a = find_announce(ids[0], AF_INET);
+    /* Keep node maintenance out of the way. */
+    confirm_nodes_time = now + 60 * 1000;
+
+    wheel_remove(a);
+    a->time = now + 600 * 1000;
+    wheel_insert(a);
+    t = periodic_sleep();
+    check(t > 30 * 1000, "an announce due later doesn't wake us up");
+
+    wheel_remove(a);
+    a->time = now + 2500;
+    wheel_insert(a);
+    t = periodic_sleep();
+    check(t > 1500 && t <= 2500 + ANNOUNCE_SLOT,
+          "we wake up when an announce is due");
+    dht_uninit();
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    srandom(1);
+    for(i = 0; i < 8; i++) {
+        dht_random_bytes(ids[i], 20);
+        closures[i] = &done[i];
+    }
+    /* Nothing is sent, but the routing tables need sockets. */
+    s = socket(PF_INET, SOCK_DGRAM, 0);
+    s6 = socket(PF_INET6, SOCK_DGRAM, 0);
+
+    test_reenter();
+    test_uninit();
+    test_announce_sleep();
+
+    return failures > 0;
+}
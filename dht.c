@@ -28,7 +28,6 @@ THE SOFTWARE.
    gratuitious changes to the coding style.  And please send back any
    improvements to the author. */
 
-/* For memmem. */
 #define _GNU_SOURCE
 
 #include <stdio.h>
@@ -39,6 +38,7 @@ THE SOFTWARE.
 
 #if !defined(_WIN32) || defined(__MINGW32__)
 #include <sys/time.h>
+#include <time.h>
 #endif
 
 #ifndef _WIN32
@@ -62,12 +62,6 @@ THE SOFTWARE.
 
 #include "dht.h"
 
-#ifndef HAVE_MEMMEM
-#ifdef __GLIBC__
-#define HAVE_MEMMEM
-#endif
-#endif
-
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
 #endif
@@ -92,6 +86,7 @@ random(void)
 /* Windows Vista and later already provide the implementation. */
 #if _WIN32_WINNT < 0x0600
 extern const char *inet_ntop(int, const void *, char *, socklen_t);
+extern int inet_pton(int, const char *, void *);
 #endif
 
 #ifdef _MSC_VER
@@ -123,38 +118,62 @@ extern const char *inet_ntop(int, const void *, char *, socklen_t);
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
 #define MIN(x, y) ((x) <= (y) ? (x) : (y))
 
+/* A compact address: just the bits that go on the wire.  IPv4 addresses
+   use the first 4 octets of ip, the rest is zero, so that two addresses
+   can be compared with memcmp.  We only build a struct sockaddr when
+   calling dht_sendto or talking to the user. */
+struct address {
+    unsigned char ip[16];
+    unsigned short port;        /* in network byte order */
+    unsigned short af;          /* 0 for no address */
+};
+
+/* All times are in milliseconds, see dht_now. */
+typedef long long dht_time_t;
+
+/* A smoothed round-trip time estimate, in milliseconds, as in RFC 6298.
+   An srtt of 0 means that we have no sample yet. */
+struct rtt {
+    int srtt;
+    int rttvar;
+};
+
+/* The id of a node is not stored here, but in its bucket's array of ids. */
 struct node {
-    unsigned char id[20];
-    struct sockaddr_storage ss;
-    int sslen;
-    time_t time;                /* time of last message received */
-    time_t reply_time;          /* time of last correct reply received */
-    time_t pinged_time;         /* time of last request */
+    struct address addr;
+    dht_time_t time;            /* time of last message received */
+    dht_time_t reply_time;      /* time of last correct reply received */
+    dht_time_t pinged_time;     /* time of last request */
     int pinged;                 /* how many requests we sent since last reply */
-    struct node *next;
+    struct rtt rtt;
 };
 
 struct bucket {
     int af;
     unsigned char first[20];
+    int depth;                  /* number of bits shared with myid */
     int count;                  /* number of nodes */
     int max_count;              /* max number of nodes for this bucket */
-    time_t time;                /* time of last reply in this bucket */
+    dht_time_t time;            /* time of last reply in this bucket */
+    /* Nodes are kept in an unordered array of max_count elements, and
+       their ids in a parallel array, so that looking up an id only
+       touches a few cache lines. */
+    unsigned char (*ids)[20];
     struct node *nodes;
-    struct sockaddr_storage cached;  /* the address of a likely candidate */
-    int cachedlen;
-    struct bucket *next;
+    struct address cached;      /* the address of a likely candidate */
+    struct bucket *next, *prev;
 };
 
 struct search_node {
     unsigned char id[20];
-    struct sockaddr_storage ss;
-    int sslen;
-    time_t request_time;        /* the time of the last unanswered request */
-    time_t reply_time;          /* the time of the last reply */
+    struct address addr;
+    dht_time_t request_time;    /* the time of the last unanswered request */
+    dht_time_t reply_time;      /* the time of the last reply */
     int pinged;
+    struct rtt rtt;
     unsigned char token[40];
     int token_len;
+    dht_time_t token_time;      /* when we got the token */
     int replied;                /* whether we have received a reply */
     int acked;                  /* whether they acked our announcement */
 };
@@ -167,22 +186,78 @@ struct search_node {
 struct search {
     unsigned short tid;
     int af;
-    time_t step_time;           /* the time of the last search_step */
+    dht_time_t step_time;       /* the time of the last search_step */
     unsigned char id[20];
     unsigned short port;        /* 0 for pure searches */
     int done;
     struct search_node nodes[SEARCH_NODES];
     int numnodes;
     struct search *next;
+    struct search *tid_next;    /* chaining in search_by_tid */
+    struct search *id_next;     /* chaining in search_by_id */
+    struct search *done_prev, *done_next; /* in done_searches if done */
+    dht_time_t next_step;       /* when to call search_step again */
+    int heap_index;             /* position in search_heap, or -1 */
+    int window;                 /* max in-flight get_peers requests */
+    int stable;                 /* replies since the 8 closest changed */
+    int queries;                /* get_peers requests sent */
+    dht_time_t start_time;      /* when dht_search was called */
+    int reason;                 /* why the lookup ended, 0 if it hasn't */
+    dht_callback_t *callback;   /* set by dht_search_many */
+    void *closure;
+    struct search_waiter *waiters; /* see search_join */
+    int numwaiters;
+    int hungry;                 /* on hungry_searches, see index_search */
+    struct search *hungry_prev, *hungry_next;
+    unsigned *peer_set;         /* see search_new_peer */
+    int peer_set_size;
+    int numpeers;               /* peers reported */
+    int duplicates;             /* peers not reported again */
+    unsigned char *found;       /* peers found by this lookup, see cache_found */
+    int found_len;
+    unsigned char *cache;       /* peers found by the last complete lookup */
+    int cache_len;
+    dht_time_t cache_time;      /* when it completed, 0 if never */
+    int cache_reason;
+    int reannounce;             /* announcing with the last lookup's tokens */
+    int quiet;                  /* refreshing the cache, see search_refresh */
+    struct announce *announce;  /* the entry of dht_announce it serves */
 };
 
-struct peer {
-    time_t time;
-    unsigned char ip[16];
-    unsigned short len;
+/* A closure of dht_search_many that joined a search in progress. */
+struct search_waiter {
+    dht_callback_t *callback;
+    void *closure;
+};
+
+/* A search queued by dht_search_many. */
+struct pending_search {
+    unsigned char id[20];
     unsigned short port;
+    int af;
+    dht_callback_t *callback;
+    void *closure;
+    int quiet;                  /* a refresh of the cache */
+};
+
+/* An info hash registered with dht_announce. */
+struct announce {
+    unsigned char id[20];
+    unsigned short port;
+    int af;
+    dht_time_t time;            /* when to announce next */
+    dht_time_t announced;       /* the last successful announce, or 0 */
+    int failures;               /* failed attempts since then */
+    int running;                /* whether its search is in progress */
+    int slot;                   /* in announce_wheel, if not running */
+    struct announce *hash_next;
+    struct announce *wheel_prev, *wheel_next;
 };
 
+/* The size of the hash tables of searches, indexed by transaction id and
+   by target. */
+#define SEARCH_HASH_SIZE 1024
+
 /* The maximum number of peers we store for a given hash. */
 #ifndef DHT_MAX_PEERS
 #define DHT_MAX_PEERS 2048
@@ -198,64 +273,166 @@ struct peer {
 #define DHT_MAX_SEARCHES 1024
 #endif
 
-/* The time after which we consider a search to be expirable. */
+/* For how long we trust the tokens we got from other nodes, in ms.  Most
+   implementations accept a token for 5 to 10 minutes. */
+#ifndef DHT_TOKEN_LIFETIME
+#define DHT_TOKEN_LIFETIME (5 * 60 * 1000)
+#endif
+
+/* The time after which we consider a search to be expirable, in ms. */
 #ifndef DHT_SEARCH_EXPIRE_TIME
-#define DHT_SEARCH_EXPIRE_TIME (62 * 60)
+#define DHT_SEARCH_EXPIRE_TIME (62 * 60 * 1000)
 #endif
 
-/* The maximum number of in-flight queries per search. */
+/* The initial number of in-flight queries per search, and the bounds
+   within which it adapts; see dht_set_parameter. */
 #ifndef DHT_INFLIGHT_QUERIES
 #define DHT_INFLIGHT_QUERIES 4
 #endif
 
-/* The retransmit timeout when performing searches. */
+#ifndef DHT_INFLIGHT_QUERIES_MIN
+#define DHT_INFLIGHT_QUERIES_MIN 2
+#endif
+
+#ifndef DHT_INFLIGHT_QUERIES_MAX
+#define DHT_INFLIGHT_QUERIES_MAX 8
+#endif
+
+/* A lookup has converged when the 8 closest nodes haven't changed over
+   this many replies, and the closest live node has replied. */
+#ifndef DHT_SEARCH_STABLE_REPLIES
+#define DHT_SEARCH_STABLE_REPLIES 8
+#endif
+
+/* The budget of a lookup, in get_peers requests and in ms. */
+#ifndef DHT_SEARCH_MAX_QUERIES
+#define DHT_SEARCH_MAX_QUERIES 64
+#endif
+
+#ifndef DHT_SEARCH_MAX_TIME
+#define DHT_SEARCH_MAX_TIME (60 * 1000)
+#endif
+
+/* The number of searches queued by dht_search_many that we start per
+   second, and the number of searches in progress beyond which we don't
+   start any. */
+#ifndef DHT_SEARCH_RATE
+#define DHT_SEARCH_RATE 20
+#endif
+
+#ifndef DHT_SEARCH_CONCURRENCY
+#define DHT_SEARCH_CONCURRENCY 64
+#endif
+
+/* For how long the peers found by a search answer repeated searches for
+   the same target, and after how long such an answer also starts a new
+   lookup (0 for never), in ms.  At most DHT_CACHE_PEERS peers are kept
+   for each target. */
+#ifndef DHT_CACHE_TTL
+#define DHT_CACHE_TTL (5 * 60 * 1000)
+#endif
+
+#ifndef DHT_CACHE_REFRESH
+#define DHT_CACHE_REFRESH 0
+#endif
+
+#ifndef DHT_CACHE_PEERS
+#define DHT_CACHE_PEERS 256
+#endif
+
+/* How often the info hashes passed to dht_announce are announced, in ms,
+   how many such announces run at once, and the delay before retrying one
+   that failed, which doubles with every failure up to the interval. */
+#ifndef DHT_ANNOUNCE_INTERVAL
+#define DHT_ANNOUNCE_INTERVAL (28 * 60 * 1000)
+#endif
+
+#ifndef DHT_ANNOUNCE_CONCURRENCY
+#define DHT_ANNOUNCE_CONCURRENCY 64
+#endif
+
+#ifndef DHT_ANNOUNCE_RETRY
+#define DHT_ANNOUNCE_RETRY (30 * 1000)
+#endif
+
+/* The timing wheel of announces has slots of ANNOUNCE_SLOT ms, and must
+   cover the interval. */
+#define ANNOUNCE_SLOT 1000
+#define ANNOUNCE_WHEEL_SIZE 4096
+
+/* The retransmit timeout when performing searches, in ms.  This is used
+   for nodes whose round-trip time we don't know yet, and as an upper
+   bound for the ones we do know. */
 #ifndef DHT_SEARCH_RETRANSMIT
-#define DHT_SEARCH_RETRANSMIT 10
+#define DHT_SEARCH_RETRANSMIT 2000
 #endif
 
+/* The smallest retransmit timeout, however fast a node, in ms. */
+#ifndef DHT_SEARCH_MIN_RETRANSMIT
+#define DHT_SEARCH_MIN_RETRANSMIT 200
+#endif
+
+/* The length of a stored peer: the string "6:" or "18:" followed by the
+   address and the port in network byte order. */
+#define PEER_LEN 8
+#define PEER6_LEN 21
+
+/* The peers of a given family, stored in exactly the form in which they
+   are sent in replies to get_peers, so that a reply is just a copy.  The
+   times of the announces are in a parallel array. */
+struct peer_list {
+    unsigned char *records;     /* numpeers records of PEER_LEN or PEER6_LEN */
+    dht_time_t *times;
+    int numpeers, maxpeers;
+    /* An open-addressing hash table of index_size slots, each holding
+       an index into records or -1. */
+    int *index;
+    int index_size;
+};
+
 struct storage {
     unsigned char id[20];
-    int numpeers, maxpeers;
-    struct peer *peers;
-    struct storage *next;
+    struct peer_list peers, peers6;
 };
 
 static struct storage * find_storage(const unsigned char *id);
+static void announce_finished(struct search *sr);
+static inline unsigned peer_hash(const unsigned char *record, int len);
 static void flush_search_node(struct search_node *n, struct search *sr);
 
-static int send_ping(const struct sockaddr *sa, int salen,
+static int send_ping(const struct address *a,
                      const unsigned char *tid, int tid_len);
-static int send_pong(const struct sockaddr *sa, int salen,
+static int send_pong(const struct address *a,
                      const unsigned char *tid, int tid_len);
-static int send_find_node(const struct sockaddr *sa, int salen,
+static int send_find_node(const struct address *a,
                           const unsigned char *tid, int tid_len,
                           const unsigned char *target, int want, int confirm);
-static int send_nodes_peers(const struct sockaddr *sa, int salen,
+static int send_nodes_peers(const struct address *a,
                             const unsigned char *tid, int tid_len,
                             const unsigned char *nodes, int nodes_len,
                             const unsigned char *nodes6, int nodes6_len,
                             int af, struct storage *st,
                             const unsigned char *token, int token_len);
-static int send_closest_nodes(const struct sockaddr *sa, int salen,
+static int send_closest_nodes(const struct address *a,
                               const unsigned char *tid, int tid_len,
                               const unsigned char *id, int want,
                               int af, struct storage *st,
                               const unsigned char *token, int token_len);
-static int send_get_peers(const struct sockaddr *sa, int salen,
+static int send_get_peers(const struct address *a,
                           unsigned char *tid, int tid_len,
                           unsigned char *infohash, int want, int confirm);
-static int send_announce_peer(const struct sockaddr *sa, int salen,
+static int send_announce_peer(const struct address *a,
                               unsigned char *tid, int tid_len,
                               unsigned char *infohas, unsigned short port,
                               unsigned char *token, int token_len, int confirm);
-static int send_peer_announced(const struct sockaddr *sa, int salen,
-                               unsigned char *tid, int tid_len);
-static int send_error(const struct sockaddr *sa, int salen,
-                      unsigned char *tid, int tid_len,
+static int send_peer_announced(const struct address *a,
+                               const unsigned char *tid, int tid_len);
+static int send_error(const struct address *a,
+                      const unsigned char *tid, int tid_len,
                       int code, const char *message);
 
 static void
-add_search_node(const unsigned char *id, const struct sockaddr *sa, int salen);
+add_search_node(const unsigned char *id, const struct address *a);
 
 #define ERROR 0
 #define REPLY 1
@@ -274,29 +451,33 @@ add_search_node(const unsigned char *id, const struct sockaddr *sa, int salen);
 #define PARSE_VALUES_LEN 2048
 #define PARSE_VALUES6_LEN 2048
 
+/* A parsed message doesn't own any data: all pointers point into the
+   received packet, and are NULL when the corresponding key is absent.
+   Values points at the contents of the bencoded list of values. */
 struct parsed_message {
-    unsigned char tid[PARSE_TID_LEN];
+    const unsigned char *tid;
     unsigned short tid_len;
-    unsigned char id[20];
-    unsigned char info_hash[20];
-    unsigned char target[20];
+    const unsigned char *id;
+    const unsigned char *info_hash;
+    const unsigned char *target;
     unsigned short port;
     unsigned short implied_port;
-    unsigned char token[PARSE_TOKEN_LEN];
+    const unsigned char *token;
     unsigned short token_len;
-    unsigned char nodes[PARSE_NODES_LEN];
+    const unsigned char *nodes;
     unsigned short nodes_len;
-    unsigned char nodes6[PARSE_NODES6_LEN];
+    const unsigned char *nodes6;
     unsigned short nodes6_len;
-    unsigned char values[PARSE_VALUES_LEN];
+    const unsigned char *values;
     unsigned short values_len;
-    unsigned char values6[PARSE_VALUES6_LEN];
-    unsigned short values6_len;
+    unsigned short numvalues, numvalues6;
     unsigned short want;
 };
 
 static int parse_message(const unsigned char *buf, int buflen,
                          struct parsed_message *m);
+static int extract_values(const struct parsed_message *m, int len,
+                          unsigned char *buf, int buflen);
 
 static const unsigned char zeroes[20] = {0};
 static const unsigned char v4prefix[16] = {
@@ -306,41 +487,202 @@ static const unsigned char v4prefix[16] = {
 static int dht_socket = -1;
 static int dht_socket6 = -1;
 
-static time_t search_time;
-static time_t confirm_nodes_time;
-static time_t rotate_secrets_time;
+static dht_time_t confirm_nodes_time;
+static dht_time_t rotate_secrets_time;
 
 static unsigned char myid[20];
-static int have_v = 0;
-static unsigned char my_v[9];
+
+/* Every message we send starts with one of these headers, which have our
+   id baked in, and ends with one of these trailers, which include our
+   version if we have one.  They are filled in by dht_init. */
+static unsigned char query_header[32];
+static unsigned char reply_header[32];
+static unsigned char query_trailer[16];
+static unsigned char reply_trailer[16];
+static unsigned char error_trailer[16];
+static int trailer_len;
 static unsigned char secret[8];
 static unsigned char oldsecret[8];
+static unsigned int peer_hash_key;
 
 static struct bucket *buckets = NULL;
 static struct bucket *buckets6 = NULL;
+
+/* Since we only ever split the bucket that contains our own id, a bucket
+   is determined by the number of leading bits its ids share with myid.
+   bucket_index[i] holds ids that share exactly i bits with myid, except
+   for bucket_index[mybucket_depth], our own bucket, which holds all ids
+   that share at least that many. */
+static struct bucket *bucket_index[161], *bucket_index6[161];
+static int mybucket_depth, mybucket6_depth;
+/* Storage lives in a dense array of numstorage entries, so that walking
+   it is cheap.  Lookups go through an open-addressing hash table of
+   storage_index_size slots, each holding an index into that array or -1. */
 static struct storage *storage;
-static int numstorage;
+static int numstorage, maxstorage;
+static int *storage_index;
+static int storage_index_size;
 
 static struct search *searches = NULL;
 static int numsearches;
 static unsigned short search_id;
-
-/* The maximum number of nodes that we snub.  There is probably little
-   reason to increase this value. */
+static struct search *search_by_tid[SEARCH_HASH_SIZE];
+static struct search *search_by_id[SEARCH_HASH_SIZE];
+/* Done searches, in the order in which they completed, so that the
+   first one is the best candidate for reuse. */
+static struct search *done_searches, *done_searches_last;
+/* Searches in progress, in a binary min-heap ordered by next_step. */
+static struct search *search_heap[DHT_MAX_SEARCHES];
+static int search_heap_size;
+/* Searches in progress that have fewer than SEARCH_NODES nodes, see
+   index_search. */
+static struct search *hungry_searches;
+
+/* The nodes that we snub, in a hash table of DHT_MAX_BLACKLISTED entries
+   split into sets of BLACKLIST_WAYS.  A node is snubbed for
+   DHT_BLACKLIST_TIME, doubled every time it offends again up to
+   DHT_BLACKLIST_MAX_TIME (define both to the same value to disable
+   escalation); its offences are remembered until its entry is needed
+   for another node. */
 #ifndef DHT_MAX_BLACKLISTED
-#define DHT_MAX_BLACKLISTED 10
+#define DHT_MAX_BLACKLISTED 2048
+#endif
+
+#ifndef DHT_BLACKLIST_TIME
+#define DHT_BLACKLIST_TIME (10 * 60 * 1000)
+#endif
+
+#ifndef DHT_BLACKLIST_MAX_TIME
+#define DHT_BLACKLIST_MAX_TIME (24 * 60 * 60 * 1000)
+#endif
+
+#define BLACKLIST_WAYS 4
+#define BLACKLIST_SETS (DHT_MAX_BLACKLISTED / BLACKLIST_WAYS)
+
+struct blacklisted {
+    struct address addr;        /* af is 0 if the entry is free */
+    dht_time_t expires;
+    int offences;
+};
+
+static struct blacklisted blacklist[DHT_MAX_BLACKLISTED];
+static int numblacklisted;
+
+/* The prefixes loaded by dht_load_filter, in a compressed binary trie
+   (one for each address family) stored in an array.  Internal nodes
+   are where prefixes diverge, and have two children; a node for one of
+   the prefixes is always a leaf, since anything below it is covered.
+   Since the first levels are the same for most lookups, start[] gives
+   the node where the walk reaches bit FILTER_STRIDE for every value of
+   the first FILTER_STRIDE bits. */
+#define FILTER_STRIDE 16
+
+struct filter_node {
+    unsigned char prefix[16];   /* the bits beyond len are 0 */
+    unsigned char len;
+    unsigned char leaf;         /* whether prefix is filtered */
+    int child[2];               /* indices in nodes */
+};
+
+struct filter {
+    struct filter_node *nodes;
+    int numnodes, maxnodes;
+    int root, root6;            /* -1 if empty */
+    int numprefixes;
+    int start[2][1 << FILTER_STRIDE]; /* IPv4 and IPv6, -1 if no match */
+};
+
+static struct filter *filter;
+
+static dht_time_t now;
+static struct rtt global_rtt;
+
+static int search_window = DHT_INFLIGHT_QUERIES;
+static int search_window_min = DHT_INFLIGHT_QUERIES_MIN;
+static int search_window_max = DHT_INFLIGHT_QUERIES_MAX;
+static int search_stable_replies = DHT_SEARCH_STABLE_REPLIES;
+static int search_max_queries = DHT_SEARCH_MAX_QUERIES;
+static int search_max_time = DHT_SEARCH_MAX_TIME;
+static int search_rate = DHT_SEARCH_RATE;
+static int search_concurrency = DHT_SEARCH_CONCURRENCY;
+static int cache_ttl = DHT_CACHE_TTL;
+static int cache_refresh = DHT_CACHE_REFRESH;
+static int cache_hits, cache_misses, cache_evictions;
+static int announce_interval = DHT_ANNOUNCE_INTERVAL;
+static int announce_concurrency = DHT_ANNOUNCE_CONCURRENCY;
+
+/* The info hashes registered with dht_announce, in a chained hash table
+   indexed by id, and those not being announced right now in a timing
+   wheel indexed by time.  The slots before announce_wheel_time have been
+   run. */
+static struct announce **announce_table;
+static int announce_table_size, numannounces, announce_running;
+static struct announce *announce_wheel[ANNOUNCE_WHEEL_SIZE];
+static dht_time_t announce_wheel_time;
+
+static struct pending_search *pending_searches;
+static int pending_first, numpending, maxpending;
+static dht_time_t pending_time;
+static dht_time_t mybucket_grow_time, mybucket6_grow_time;
+static dht_time_t expire_stuff_time;
+
+/* The current time in milliseconds.  We use a monotonic clock where we
+   have one, so that timeouts survive the wall clock being stepped.  The
+   origin is offset by a day so that a time of 0 is always long ago. */
+static dht_time_t
+dht_now(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) >= 0)
+        return 24 * 60 * 60 * 1000LL +
+            (dht_time_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    {
+        struct timeval tv;
+        dht_gettimeofday(&tv, NULL);
+        return (dht_time_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+}
+
+/* The maximum amount of expiry work done by a single call to
+   dht_periodic, counted in nodes and peers. */
+#ifndef DHT_EXPIRE_BUDGET
+#define DHT_EXPIRE_BUDGET 1024
+#endif
+
+/* The pause between two such calls, in milliseconds. */
+#ifndef DHT_EXPIRE_PAUSE
+#define DHT_EXPIRE_PAUSE 5
 #endif
-static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
-int next_blacklisted;
 
-static struct timeval now;
-static time_t mybucket_grow_time, mybucket6_grow_time;
-static time_t expire_stuff_time;
+/* The state of an incremental sweep, see expire_stuff. */
+static int expire_in_progress;
+static struct bucket *expire_bucket_cursor;
+static int expire_storage_cursor;
 
 #define MAX_TOKEN_BUCKET_TOKENS 400
-static time_t token_bucket_time;
+static dht_time_t token_bucket_time;
 static int token_bucket_tokens;
 
+/* Every source of requests, an IPv4 address or an IPv6 /64, also has a
+   share of SOURCE_BUCKET_ROWS buckets, one per row chosen by a keyed hash
+   of its address, that refill at one token every SOURCE_TOKEN_INTERVAL
+   ms.  A request is accepted as long as one of them has tokens left: a
+   heavy hitter empties all of its buckets, while a well-behaved source
+   that shares one of them has little chance of sharing the other. */
+#define SOURCE_BUCKET_ROWS 2
+#define SOURCE_BUCKETS 1024
+#define MAX_SOURCE_BUCKET_TOKENS 40
+#define SOURCE_TOKEN_INTERVAL 100
+
+struct source_bucket {
+    dht_time_t time;
+    int tokens;
+};
+
+static struct source_bucket source_buckets[SOURCE_BUCKET_ROWS][SOURCE_BUCKETS];
+
 FILE *dht_debug = NULL;
 
 #ifdef __GNUC__
@@ -377,28 +719,90 @@ print_hex(FILE *f, const unsigned char *buf, int buflen)
 }
 
 static int
-is_martian(const struct sockaddr *sa)
+sockaddr_to_address(const struct sockaddr *sa, int salen, struct address *a)
+{
+    memset(a, 0, sizeof(*a));
+    if(sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+        if(salen < (int)sizeof(struct sockaddr_in))
+            return -1;
+        memcpy(a->ip, &sin->sin_addr, 4);
+        a->port = sin->sin_port;
+    } else if(sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+        if(salen < (int)sizeof(struct sockaddr_in6))
+            return -1;
+        memcpy(a->ip, &sin6->sin6_addr, 16);
+        a->port = sin6->sin6_port;
+    } else {
+        return -1;
+    }
+    a->af = sa->sa_family;
+    return 1;
+}
+
+/* Returns the length of the sockaddr, or -1 if it doesn't fit in salen. */
+static int
+address_to_sockaddr(const struct address *a, struct sockaddr *sa, int salen)
 {
-    switch(sa->sa_family) {
-    case AF_INET: {
+    if(a->af == AF_INET) {
         struct sockaddr_in *sin = (struct sockaddr_in*)sa;
-        const unsigned char *address = (const unsigned char*)&sin->sin_addr;
-        return sin->sin_port == 0 ||
+        if(salen < (int)sizeof(struct sockaddr_in))
+            return -1;
+        memset(sin, 0, sizeof(struct sockaddr_in));
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, a->ip, 4);
+        sin->sin_port = a->port;
+        return sizeof(struct sockaddr_in);
+    } else if(a->af == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
+        if(salen < (int)sizeof(struct sockaddr_in6))
+            return -1;
+        memset(sin6, 0, sizeof(struct sockaddr_in6));
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, a->ip, 16);
+        sin6->sin6_port = a->port;
+        return sizeof(struct sockaddr_in6);
+    } else {
+        return -1;
+    }
+}
+
+/* Decode the address part of a compact node info, 6 or 18 octets. */
+static void
+compact_to_address(const unsigned char *buf, int af, struct address *a)
+{
+    int len = af == AF_INET ? 4 : 16;
+    memset(a, 0, sizeof(*a));
+    memcpy(a->ip, buf, len);
+    memcpy(&a->port, buf + len, 2);
+    a->af = af;
+}
+
+static inline int
+address_equal(const struct address *a1, const struct address *a2)
+{
+    return memcmp(a1, a2, sizeof(struct address)) == 0;
+}
+
+static int
+is_martian(const struct address *a)
+{
+    const unsigned char *address = a->ip;
+
+    switch(a->af) {
+    case AF_INET:
+        return a->port == 0 ||
             (address[0] == 0) ||
             (address[0] == 127) ||
             ((address[0] & 0xE0) == 0xE0);
-    }
-    case AF_INET6: {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
-        const unsigned char *address = (const unsigned char*)&sin6->sin6_addr;
-        return sin6->sin6_port == 0 ||
+    case AF_INET6:
+        return a->port == 0 ||
             (address[0] == 0xFF) ||
             (address[0] == 0xFE && (address[1] & 0xC0) == 0x80) ||
             (memcmp(address, zeroes, 15) == 0 &&
              (address[15] == 0 || address[15] == 1)) ||
             (memcmp(address, v4prefix, 12) == 0);
-    }
-
     default:
         return 0;
     }
@@ -414,6 +818,15 @@ id_cmp(const unsigned char *restrict id1, const unsigned char *restrict id2)
     return memcmp(id1, id2, 20);
 }
 
+/* Ids are uniformly distributed, so we simply use some of their octets as
+   a hash.  Not the first ones: the info hashes that we store are close to
+   our id, so that their first bits are mostly the same. */
+static inline unsigned
+id_hash(const unsigned char *id)
+{
+    return ((unsigned)id[16] << 24) | (id[17] << 16) | (id[18] << 8) | id[19];
+}
+
 /* Find the lowest 1 bit in an id. */
 static int
 lowbit(const unsigned char *id)
@@ -478,85 +891,118 @@ xorcmp(const unsigned char *id1, const unsigned char *id2,
     return 0;
 }
 
-/* We keep buckets in a sorted linked list.  A bucket b ranges from
-   b->first inclusive up to b->next->first exclusive. */
+/* We keep buckets in a sorted doubly linked list.  A bucket b ranges from
+   b->first inclusive up to b->next->first exclusive.  In addition, buckets
+   are indexed by depth, see bucket_index above. */
 static int
 in_bucket(const unsigned char *id, struct bucket *b)
 {
-    return id_cmp(b->first, id) <= 0 &&
-        (b->next == NULL || id_cmp(id, b->next->first) < 0);
+    int depth = b->af == AF_INET ? mybucket_depth : mybucket6_depth;
+    int bits = common_bits(id, myid);
+
+    if(b->depth == depth)
+        return bits >= depth;
+    else
+        return bits == b->depth;
 }
 
 static struct bucket *
 find_bucket(unsigned const char *id, int af)
 {
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
-
-    if(b == NULL)
+    if(af == AF_INET)
+        return bucket_index[MIN(common_bits(id, myid), mybucket_depth)];
+    else if(af == AF_INET6)
+        return bucket_index6[MIN(common_bits(id, myid), mybucket6_depth)];
+    else
         return NULL;
-
-    while(1) {
-        if(b->next == NULL)
-            return b;
-        if(id_cmp(id, b->next->first) < 0)
-            return b;
-        b = b->next;
-    }
 }
 
 static struct bucket *
 previous_bucket(struct bucket *b)
 {
-    struct bucket *p = b->af == AF_INET ? buckets : buckets6;
+    return b->prev;
+}
 
-    if(b == p)
-        return NULL;
+/* Allocate the arrays of nodes of an empty bucket. */
+static int
+bucket_alloc(struct bucket *b, int max_count)
+{
+    unsigned char (*ids)[20];
+    struct node *nodes;
 
-    while(1) {
-        if(p->next == NULL)
-            return NULL;
-        if(p->next == b)
-            return p;
-        p = p->next;
+    ids = malloc(max_count * 20);
+    if(ids == NULL)
+        return -1;
+    nodes = calloc(max_count, sizeof(struct node));
+    if(nodes == NULL) {
+        free(ids);
+        return -1;
+    }
+
+    b->ids = ids;
+    b->nodes = nodes;
+    b->count = 0;
+    b->max_count = max_count;
+    return 1;
+}
+
+static void
+bucket_free(struct bucket *b)
+{
+    free(b->ids);
+    free(b->nodes);
+    free(b);
+}
+
+/* Return the index of a node within its bucket, or -1. */
+static int
+bucket_find(struct bucket *b, const unsigned char *id)
+{
+    int i;
+    for(i = 0; i < b->count; i++) {
+        if(id_cmp(b->ids[i], id) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Remove a node from a bucket, filling the hole with the last node. */
+static void
+bucket_remove(struct bucket *b, int i)
+{
+    b->count--;
+    if(i < b->count) {
+        memcpy(b->ids[i], b->ids[b->count], 20);
+        b->nodes[i] = b->nodes[b->count];
     }
 }
 
-/* Every bucket contains an unordered list of nodes. */
 static struct node *
-find_node(const unsigned char *id, int af)
+find_node(const unsigned char *id, int af, struct bucket **bucket_return)
 {
     struct bucket *b = find_bucket(id, af);
-    struct node *n;
+    int i;
 
     if(b == NULL)
         return NULL;
 
-    n = b->nodes;
-    while(n) {
-        if(id_cmp(n->id, id) == 0)
-            return n;
-        n = n->next;
-    }
-    return NULL;
+    i = bucket_find(b, id);
+    if(i < 0)
+        return NULL;
+
+    if(bucket_return)
+        *bucket_return = b;
+    return &b->nodes[i];
 }
 
 /* Return a random node in a bucket. */
 static struct node *
 random_node(struct bucket *b)
 {
-    struct node *n;
-    int nn;
-
     if(b->count == 0)
         return NULL;
 
-    nn = random() % b->count;
-    n = b->nodes;
-    while(nn > 0 && n) {
-        n = n->next;
-        nn--;
-    }
-    return n;
+    return &b->nodes[random() % b->count];
 }
 
 /* Return the middle id of a bucket. */
@@ -603,8 +1049,52 @@ node_good(struct node *node)
 {
     return
         node->pinged <= 2 &&
-        node->reply_time >= now.tv_sec - 7200 &&
-        node->time >= now.tv_sec - 900;
+        node->reply_time >= now - 2 * 60 * 60 * 1000 &&
+        node->time >= now - 15 * 60 * 1000;
+}
+
+static void
+rtt_update(struct rtt *rtt, int r)
+{
+    if(rtt->srtt == 0) {
+        rtt->srtt = r;
+        rtt->rttvar = r / 2;
+    } else {
+        rtt->rttvar = (3 * rtt->rttvar + abs(rtt->srtt - r)) / 4;
+        rtt->srtt = (7 * rtt->srtt + r) / 8;
+    }
+}
+
+/* Feed a round-trip time measurement to a node's estimator.  We also
+   keep an estimate over all nodes, which is used for the nodes that we
+   haven't heard from yet -- most of a search's nodes are only known
+   from other nodes' replies. */
+static void
+rtt_sample(struct rtt *rtt, dht_time_t sample)
+{
+    int r = (int)MIN(MAX(sample, 1), 60 * 1000);
+    rtt_update(rtt, r);
+    rtt_update(&global_rtt, r);
+}
+
+/* The retransmit timeout after the given number of unanswered requests.
+   It doubles with every retransmission, but never exceeds
+   DHT_SEARCH_RETRANSMIT: a slow node is not worth waiting for when
+   there are others to ask. */
+static int
+rtt_timeout(const struct rtt *rtt, int pinged)
+{
+    int rto;
+
+    if(rtt->srtt == 0)
+        rtt = &global_rtt;
+    if(rtt->srtt == 0)
+        return DHT_SEARCH_RETRANSMIT;
+
+    rto = MAX(rtt->srtt + 4 * rtt->rttvar, DHT_SEARCH_MIN_RETRANSMIT);
+    if(pinged > 1)
+        rto <<= MIN(pinged - 1, 4);
+    return MIN(rto, DHT_SEARCH_RETRANSMIT);
 }
 
 /* Our transaction-ids are 4-bytes long, with the first two bytes identi-
@@ -638,14 +1128,13 @@ send_cached_ping(struct bucket *b)
     unsigned char tid[4];
     int rc;
     /* We set family to 0 when there's no cached node. */
-    if(b->cached.ss_family == 0)
+    if(b->cached.af == 0)
         return 0;
 
     debugf("Sending ping to cached node.\n");
     make_tid(tid, "pn", 0);
-    rc = send_ping((struct sockaddr*)&b->cached, b->cachedlen, tid, 4);
-    b->cached.ss_family = 0;
-    b->cachedlen = 0;
+    rc = send_ping(&b->cached, tid, 4);
+    b->cached.af = 0;
     return rc;
 }
 
@@ -655,289 +1144,568 @@ static void
 pinged(struct node *n, struct bucket *b)
 {
     n->pinged++;
-    n->pinged_time = now.tv_sec;
+    n->pinged_time = now;
     if(n->pinged >= 3)
-        send_cached_ping(b ? b : find_bucket(n->id, n->ss.ss_family));
+        send_cached_ping(b);
 }
 
-/* The internal blacklist is an LRU cache of nodes that have sent
-   incorrect messages. */
-static void
-blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
+static inline int
+prefix_bit(const unsigned char *prefix, int i)
 {
-    int i;
-
-    debugf("Blacklisting broken node.\n");
-
-    if(id) {
-        struct node *n;
-        struct search *sr;
-        /* Make the node easy to discard. */
-        n = find_node(id, sa->sa_family);
-        if(n) {
-            n->pinged = 3;
-            pinged(n, NULL);
-        }
-        /* Discard it from any searches in progress. */
-        sr = searches;
-        while(sr) {
-            for(i = 0; i < sr->numnodes; i++)
-                if(id_cmp(sr->nodes[i].id, id) == 0)
-                    flush_search_node(&sr->nodes[i], sr);
-            sr = sr->next;
-        }
-    }
-    /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
+    return (prefix[i / 8] >> (7 - i % 8)) & 1;
 }
 
+/* The number of leading bits that a and b have in common, at most len. */
 static int
-node_blacklisted(const struct sockaddr *sa, int salen)
+prefix_common(const unsigned char *a, const unsigned char *b, int len)
 {
-    int i;
-
-    if((unsigned)salen > sizeof(struct sockaddr_storage))
-        abort();
-
-    if(dht_blacklisted(sa, salen))
-        return 1;
-
-    for(i = 0; i < DHT_MAX_BLACKLISTED; i++) {
-        if(memcmp(&blacklist[i], sa, salen) == 0)
-            return 1;
-    }
-
-    return 0;
+    int i = 0;
+    while(i + 8 <= len && a[i / 8] == b[i / 8])
+        i += 8;
+    while(i < len && prefix_bit(a, i) == prefix_bit(b, i))
+        i++;
+    return i;
 }
 
-static struct node *
-append_nodes(struct node *n1, struct node *n2)
+/* Whether a is within one of the filtered prefixes.  The walk only
+   tests one bit per node; all the leaves below a node share its prefix,
+   so the full comparison is only needed at the leaf we end up on. */
+static int
+filter_match(const struct filter *f, const struct address *a)
 {
-    struct node *n;
+    int i = f->start[a->af == AF_INET ? 0 : 1][(a->ip[0] << 8) | a->ip[1]];
+    const struct filter_node *n;
 
-    if(n1 == NULL)
-        return n2;
+    if(i < 0)
+        return 0;
 
-    if(n2 == NULL)
-        return n1;
+    n = &f->nodes[i];
+    while(!n->leaf)
+        n = &f->nodes[n->child[prefix_bit(a->ip, n->len)]];
 
-    n = n1;
-    while(n->next != NULL)
-        n = n->next;
+    return prefix_common(n->prefix, a->ip, n->len) == n->len;
+}
 
-    n->next = n2;
-    return n1;
+static int
+filter_new_node(struct filter *f, const unsigned char *prefix, int len,
+                int leaf)
+{
+    struct filter_node *n = &f->nodes[f->numnodes];
+    memcpy(n->prefix, prefix, 16);
+    n->len = len;
+    n->leaf = leaf;
+    n->child[0] = n->child[1] = -1;
+    return f->numnodes++;
 }
 
-/* Insert a new node into a bucket, don't check for duplicates.
-   Returns 1 if the node was inserted, 0 if a bucket must be split. */
+/* Add a prefix whose bits beyond len are 0. */
 static int
-insert_node(struct node *node, struct bucket **split_return)
+filter_insert(struct filter *f, int af, const unsigned char *prefix, int len)
 {
-    struct bucket *b = find_bucket(node->id, node->ss.ss_family);
+    int *link = af == AF_INET ? &f->root : &f->root6;
+    int c = 0;
+
+    /* We add at most two nodes; make room first, so that link stays
+       valid. */
+    if(f->numnodes + 2 > f->maxnodes) {
+        int n = MAX(2 * f->maxnodes, 256);
+        struct filter_node *new_nodes;
+        new_nodes = realloc(f->nodes, n * sizeof(struct filter_node));
+        if(new_nodes == NULL)
+            return -1;
+        f->nodes = new_nodes;
+        f->maxnodes = n;
+    }
 
-    if(b == NULL)
-        return -1;
+    while(*link >= 0) {
+        struct filter_node *n = &f->nodes[*link];
+        c = prefix_common(n->prefix, prefix, MIN(n->len, len));
+        if(c < n->len)
+            break;
+        /* Already covered. */
+        if(n->leaf)
+            return 0;
+        if(n->len == len) {
+            /* This covers the whole subtree, which is left unreachable. */
+            n->leaf = 1;
+            return 1;
+        }
+        link = &n->child[prefix_bit(prefix, n->len)];
+    }
 
-    if(b->count >= b->max_count) {
-        *split_return = b;
-        return 0;
+    if(*link < 0) {
+        *link = filter_new_node(f, prefix, len, 1);
+    } else if(c == len) {
+        /* A new prefix above an existing subtree covers it. */
+        *link = filter_new_node(f, prefix, len, 1);
+    } else {
+        /* Diverge at bit c. */
+        int old = *link, i;
+        unsigned char common[16];
+        memset(common, 0, 16);
+        memcpy(common, prefix, c / 8);
+        if(c % 8)
+            common[c / 8] = prefix[c / 8] & (0xFF << (8 - c % 8));
+        i = filter_new_node(f, common, c, 0);
+        f->nodes[i].child[prefix_bit(prefix, c)] =
+            filter_new_node(f, prefix, len, 1);
+        f->nodes[i].child[!prefix_bit(prefix, c)] = old;
+        *link = i;
     }
-    node->next = b->nodes;
-    b->nodes = node;
-    b->count++;
     return 1;
 }
 
-/* Splits a bucket, and returns the list of nodes that must be reinserted
-   into the routing table. */
+/* The number of prefixes reachable from node i, that is, of those not
+   covered by another. */
 static int
-split_bucket_helper(struct bucket *b, struct node **nodes_return)
+filter_count(const struct filter *f, int i)
 {
-    struct bucket *new;
-    int rc;
-    unsigned char new_id[20];
+    if(i < 0)
+        return 0;
+    if(f->nodes[i].leaf)
+        return 1;
+    return filter_count(f, f->nodes[i].child[0]) +
+        filter_count(f, f->nodes[i].child[1]);
+}
 
-    if(!in_bucket(myid, b)) {
-        debugf("Attempted to split wrong bucket.\n");
-        return -1;
+static void
+filter_fill_start(struct filter *f)
+{
+    int af, v;
+
+    for(af = 0; af < 2; af++) {
+        for(v = 0; v < (1 << FILTER_STRIDE); v++) {
+            unsigned char key[2] = {v >> 8, v & 0xFF};
+            int i = af == 0 ? f->root : f->root6;
+            while(i >= 0 && !f->nodes[i].leaf &&
+                  f->nodes[i].len < FILTER_STRIDE)
+                i = f->nodes[i].child[prefix_bit(key, f->nodes[i].len)];
+            f->start[af][v] = i;
+        }
     }
+}
 
-    rc = bucket_middle(b, new_id);
-    if(rc < 0)
-        return -1;
-
-    new = calloc(1, sizeof(struct bucket));
-    if(new == NULL)
+static void
+free_filter(struct filter *f)
+{
+    if(f) {
+        free(f->nodes);
+        free(f);
+    }
+}
+
+/* Load a list of prefixes, one per line in the form address/length or
+   a bare address, with # starting a comment.  The new filter replaces
+   the current one only once it has been completely built, so that
+   a failure leaves the current one in place. */
+int
+dht_load_filter(const char *filename)
+{
+    struct filter *f;
+    FILE *file;
+    char line[256];
+    int lineno = 0;
+
+    if(filename == NULL) {
+        free_filter(filter);
+        filter = NULL;
+        return 0;
+    }
+
+    file = fopen(filename, "r");
+    if(file == NULL)
         return -1;
 
-    send_cached_ping(b);
+    f = calloc(1, sizeof(struct filter));
+    if(f == NULL) {
+        fclose(file);
+        errno = ENOMEM;
+        return -1;
+    }
+    f->root = f->root6 = -1;
+
+    while(fgets(line, sizeof(line), file)) {
+        unsigned char prefix[16];
+        char *p, *slash, *end;
+        int af, len, max, i;
+
+        lineno++;
+        if(strchr(line, '\n') == NULL) {
+            /* Only the first word counts, skip the rest of a long line. */
+            int ch;
+            do {
+                ch = getc(file);
+            } while(ch != EOF && ch != '\n');
+        }
+        p = strchr(line, '#');
+        if(p)
+            *p = '\0';
+        p = line + strspn(line, " \t\r\n");
+        p[strcspn(p, " \t\r\n")] = '\0';
+        if(*p == '\0')
+            continue;
 
-    new->af = b->af;
-    memcpy(new->first, new_id, 20);
-    new->time = b->time;
+        slash = strchr(p, '/');
+        if(slash)
+            *slash = '\0';
+        memset(prefix, 0, 16);
+        if(inet_pton(AF_INET, p, prefix) > 0) {
+            af = AF_INET;
+            max = 32;
+        } else if(inet_pton(AF_INET6, p, prefix) > 0) {
+            af = AF_INET6;
+            max = 128;
+        } else {
+            goto bad;
+        }
 
-    *nodes_return = b->nodes;
-    b->nodes = NULL;
-    b->count = 0;
-    new->next = b->next;
-    b->next = new;
+        len = max;
+        if(slash) {
+            len = strtol(slash + 1, &end, 10);
+            if(end == slash + 1 || *end != '\0' || len < 0 || len > max)
+                goto bad;
+        }
 
-    if(in_bucket(myid, b)) {
-        new->max_count = b->max_count;
-        b->max_count = MAX(b->max_count / 2, 8);
-    } else {
-        new->max_count = MAX(b->max_count / 2, 8);
+        for(i = len; i < max; i++)
+            prefix[i / 8] &= ~(0x80 >> (i % 8));
+
+        if(filter_insert(f, af, prefix, len) < 0) {
+            fclose(file);
+            free_filter(f);
+            errno = ENOMEM;
+            return -1;
+        }
     }
 
-    return 1;
+    if(ferror(file)) {
+        fclose(file);
+        free_filter(f);
+        errno = EIO;
+        return -1;
+    }
+    fclose(file);
+
+    f->numprefixes = filter_count(f, f->root) + filter_count(f, f->root6);
+    filter_fill_start(f);
+    debugf("Loaded filter with %d prefixes (%d nodes).\n",
+           f->numprefixes, f->numnodes);
+    free_filter(filter);
+    filter = f;
+    return f->numprefixes;
+
+ bad:
+    debugf("Malformed prefix at %s:%d.\n", filename, lineno);
+    fclose(file);
+    free_filter(f);
+    errno = EINVAL;
+    return -1;
+}
+
+/* The set of blacklist entries where a would be.  This is on the path
+   of every packet, so hash a word at a time; the key is the same as for
+   peer_hash. */
+static struct blacklisted *
+blacklist_set(const struct address *a)
+{
+    unsigned h = peer_hash_key, w;
+    int i;
+
+    for(i = 0; i < (a->af == AF_INET ? 4 : 16); i += 4) {
+        memcpy(&w, a->ip + i, 4);
+        h = (h ^ w) * 0x9E3779B1;
+    }
+    h = (h ^ a->port) * 0x9E3779B1;
+    h ^= h >> 16;
+    return &blacklist[h % BLACKLIST_SETS * BLACKLIST_WAYS];
+}
+
+/* The internal blacklist holds nodes that have sent incorrect
+   messages. */
+static void
+blacklist_node(const unsigned char *id, const struct address *a)
+{
+    struct blacklisted *set, *e = NULL;
+    int i;
+
+    debugf("Blacklisting broken node.\n");
+
+    if(id) {
+        struct node *n;
+        struct bucket *b;
+        struct search *sr;
+        /* Make the node easy to discard. */
+        n = find_node(id, a->af, &b);
+        if(n) {
+            n->pinged = 3;
+            pinged(n, b);
+        }
+        /* Discard it from any searches in progress. */
+        sr = searches;
+        while(sr) {
+            for(i = 0; i < sr->numnodes; i++)
+                if(id_cmp(sr->nodes[i].id, id) == 0)
+                    flush_search_node(&sr->nodes[i], sr);
+            sr = sr->next;
+        }
+    }
+    /* And make sure we don't hear from it again for a while. */
+    set = blacklist_set(a);
+    for(i = 0; i < BLACKLIST_WAYS; i++) {
+        if(address_equal(&set[i].addr, a)) {
+            e = &set[i];
+            break;
+        }
+    }
+    if(e == NULL) {
+        /* A free entry, or else the one that expires first. */
+        e = &set[0];
+        for(i = 1; i < BLACKLIST_WAYS; i++) {
+            if(set[i].expires < e->expires)
+                e = &set[i];
+        }
+        if(e->addr.af == 0)
+            numblacklisted++;
+        e->addr = *a;
+        e->offences = 0;
+    }
+    e->offences++;
+    e->expires = now + MIN((dht_time_t)DHT_BLACKLIST_TIME <<
+                           MIN(e->offences - 1, 16),
+                           DHT_BLACKLIST_MAX_TIME);
+}
+
+static int
+node_blacklisted(const struct address *a)
+{
+    struct sockaddr_storage ss;
+    int i, sslen;
+
+    if(numblacklisted > 0) {
+        struct blacklisted *set = blacklist_set(a);
+        for(i = 0; i < BLACKLIST_WAYS; i++) {
+            if(set[i].expires > now && address_equal(&set[i].addr, a))
+                return 1;
+        }
+    }
+
+    if(filter && filter_match(filter, a))
+        return 1;
+
+    sslen = address_to_sockaddr(a, (struct sockaddr*)&ss, sizeof(ss));
+    if(sslen < 0)
+        return 1;
+
+    return dht_blacklisted((struct sockaddr*)&ss, sslen);
+}
+
+static int split_bucket(struct bucket *b);
+
+/* Reinsert a node after its bucket has been split.  If the node falls
+   into our own bucket and that is full, we split it further; otherwise,
+   the node is dropped. */
+static void
+reinsert_node(const unsigned char *id, const struct node *node)
+{
+    struct bucket *b;
+
+    while(1) {
+        b = find_bucket(id, node->addr.af);
+        if(b == NULL)
+            return;
+        if(b->count < b->max_count) {
+            memcpy(b->ids[b->count], id, 20);
+            b->nodes[b->count] = *node;
+            b->count++;
+            return;
+        }
+        if(!in_bucket(myid, b))
+            return;
+        debugf("Splitting (recursive).\n");
+        if(split_bucket(b) < 0) {
+            debugf("Couldn't split bucket.\n");
+            return;
+        }
+    }
 }
 
+/* Splits our own bucket, and reinserts its nodes into the two halves. */
 static int
 split_bucket(struct bucket *b)
 {
-    int rc;
-    struct node *nodes = NULL;
-    struct node *n = NULL;
+    struct bucket *new, *mine, *other;
+    unsigned char (*ids)[20] = b->ids;
+    struct node *nodes = b->nodes;
+    int count = b->count, max_count = b->max_count, half;
+    int i, rc;
+    unsigned char new_id[20];
 
     debugf("Splitting.\n");
-    rc = split_bucket_helper(b, &nodes);
+
+    if(!in_bucket(myid, b)) {
+        debugf("Attempted to split wrong bucket.\n");
+        return -1;
+    }
+
+    rc = bucket_middle(b, new_id);
+    if(rc < 0)
+        return -1;
+
+    new = calloc(1, sizeof(struct bucket));
+    if(new == NULL)
+        return -1;
+
+    /* Whichever half contains myid becomes our bucket, one bit deeper;
+       the other half keeps the size of the original bucket. */
+    half = MAX(max_count / 2, 8);
+    if(id_cmp(myid, new_id) < 0) {
+        mine = b;
+        other = new;
+    } else {
+        mine = new;
+        other = b;
+    }
+
+    rc = bucket_alloc(new, new == mine ? half : max_count);
+    if(rc < 0) {
+        free(new);
+        return -1;
+    }
+    rc = bucket_alloc(b, b == mine ? half : max_count);
     if(rc < 0) {
-        debugf("Couldn't split bucket");
+        free(new->ids);
+        free(new->nodes);
+        free(new);
         return -1;
     }
 
-    while(n != NULL || nodes != NULL) {
-        struct bucket *split = NULL;
-        if(n == NULL) {
-            n = nodes;
-            nodes = nodes->next;
-            n->next = NULL;
-        }
-        rc = insert_node(n, &split);
-        if(rc < 0) {
-            debugf("Couldn't insert node.\n");
-            free(n);
-            n = NULL;
-        } else if(rc > 0) {
-            n = NULL;
-        } else if(!in_bucket(myid, split)) {
-            free(n);
-            n = NULL;
-        } else {
-            struct node *insert = NULL;
-            debugf("Splitting (recursive).\n");
-            rc = split_bucket_helper(split, &insert);
-            if(rc < 0) {
-                debugf("Couldn't split bucket.\n");
-                free(n);
-                n = NULL;
-            } else {
-                nodes = append_nodes(nodes, insert);
-            }
-        }
+    send_cached_ping(b);
+
+    new->af = b->af;
+    memcpy(new->first, new_id, 20);
+    new->time = b->time;
+
+    new->next = b->next;
+    new->prev = b;
+    if(new->next)
+        new->next->prev = new;
+    b->next = new;
+
+    other->depth = b->depth;
+    mine->depth = b->depth + 1;
+
+    if(b->af == AF_INET) {
+        bucket_index[other->depth] = other;
+        bucket_index[mine->depth] = mine;
+        mybucket_depth = mine->depth;
+    } else {
+        bucket_index6[other->depth] = other;
+        bucket_index6[mine->depth] = mine;
+        mybucket6_depth = mine->depth;
     }
+
+    for(i = 0; i < count; i++)
+        reinsert_node(ids[i], &nodes[i]);
+
+    free(ids);
+    free(nodes);
     return 1;
 }
 
 /* We just learnt about a node, not necessarily a new one.  Confirm is 1 if
    the node sent a message, 2 if it sent us a reply. */
 static struct node *
-new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
-         int confirm)
+new_node(const unsigned char *id, const struct address *a, int confirm)
 {
     struct bucket *b;
     struct node *n;
-    int mybucket;
+    int mybucket, i;
 
  again:
 
-    b = find_bucket(id, sa->sa_family);
+    b = find_bucket(id, a->af);
     if(b == NULL)
         return NULL;
 
     if(id_cmp(id, myid) == 0)
         return NULL;
 
-    if(is_martian(sa) || node_blacklisted(sa, salen))
+    if(is_martian(a) || node_blacklisted(a))
         return NULL;
 
     mybucket = in_bucket(myid, b);
 
     if(confirm == 2)
-        b->time = now.tv_sec;
-
-    n = b->nodes;
-    while(n) {
-        if(id_cmp(n->id, id) == 0) {
-            if(confirm || n->time < now.tv_sec - 15 * 60) {
-                /* Known node.  Update stuff. */
-                memcpy((struct sockaddr*)&n->ss, sa, salen);
-                if(confirm)
-                    n->time = now.tv_sec;
-                if(confirm >= 2) {
-                    n->reply_time = now.tv_sec;
-                    n->pinged = 0;
-                    n->pinged_time = 0;
-                }
+        b->time = now;
+
+    i = bucket_find(b, id);
+    if(i >= 0) {
+        n = &b->nodes[i];
+        if(confirm || n->time < now - 15 * 60 * 1000) {
+            /* Known node.  Update stuff. */
+            n->addr = *a;
+            if(confirm)
+                n->time = now;
+            if(confirm >= 2) {
+                /* Karn's rule: only sample unambiguous replies. */
+                if(n->pinged == 1 && n->pinged_time > 0)
+                    rtt_sample(&n->rtt, now - n->pinged_time);
+                n->reply_time = now;
+                n->pinged = 0;
+                n->pinged_time = 0;
             }
-            if(confirm == 2)
-                add_search_node(id, sa, salen);
-            return n;
         }
-        n = n->next;
+        if(confirm == 2)
+            add_search_node(id, a);
+        return n;
     }
 
     /* New node. */
 
     if(mybucket) {
-        if(sa->sa_family == AF_INET)
-            mybucket_grow_time = now.tv_sec;
+        if(a->af == AF_INET)
+            mybucket_grow_time = now;
         else
-            mybucket6_grow_time = now.tv_sec;
+            mybucket6_grow_time = now;
     }
 
     /* First, try to get rid of a known-bad node. */
-    n = b->nodes;
-    while(n) {
-        if(n->pinged >= 3 && n->pinged_time < now.tv_sec - 15) {
-            memcpy(n->id, id, 20);
-            memcpy((struct sockaddr*)&n->ss, sa, salen);
-            n->time = confirm ? now.tv_sec : 0;
-            n->reply_time = confirm >= 2 ? now.tv_sec : 0;
+    for(i = 0; i < b->count; i++) {
+        n = &b->nodes[i];
+        if(n->pinged >= 3 && n->pinged_time < now - 15 * 1000) {
+            memcpy(b->ids[i], id, 20);
+            n->addr = *a;
+            n->time = confirm ? now : 0;
+            n->reply_time = confirm >= 2 ? now : 0;
             n->pinged_time = 0;
             n->pinged = 0;
+            memset(&n->rtt, 0, sizeof(n->rtt));
             if(confirm == 2)
-                add_search_node(id, sa, salen);
+                add_search_node(id, a);
             return n;
         }
-        n = n->next;
     }
 
     if(b->count >= b->max_count) {
         /* Bucket full.  Ping a dubious node */
         int dubious = 0;
-        n = b->nodes;
-        while(n) {
+        for(i = 0; i < b->count; i++) {
+            n = &b->nodes[i];
             /* Pick the first dubious node that we haven't pinged in the
                last 15 seconds.  This gives nodes the time to reply, but
                tends to concentrate on the same nodes, so that we get rid
                of bad nodes fast. */
             if(!node_good(n)) {
                 dubious = 1;
-                if(n->pinged_time < now.tv_sec - 15) {
+                if(n->pinged_time < now - 15 * 1000) {
                     unsigned char tid[4];
                     debugf("Sending ping to dubious node.\n");
                     make_tid(tid, "pn", 0);
-                    send_ping((struct sockaddr*)&n->ss, n->sslen,
-                              tid, 4);
+                    send_ping(&n->addr, tid, 4);
                     n->pinged++;
-                    n->pinged_time = now.tv_sec;
+                    n->pinged_time = now;
                     break;
                 }
             }
-            n = n->next;
         }
 
         if(mybucket && !dubious) {
@@ -945,74 +1713,54 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
             rc = split_bucket(b);
             if(rc > 0)
                 goto again;
+            debugf("Couldn't split bucket.\n");
             return NULL;
         }
 
         /* No space for this node.  Cache it away for later. */
-        if(confirm || b->cached.ss_family == 0) {
-            memcpy(&b->cached, sa, salen);
-            b->cachedlen = salen;
-        }
+        if(confirm || b->cached.af == 0)
+            b->cached = *a;
 
         if(confirm == 2)
-            add_search_node(id, sa, salen);
+            add_search_node(id, a);
         return NULL;
     }
 
     /* Create a new node. */
-    n = calloc(1, sizeof(struct node));
-    if(n == NULL)
-        return NULL;
-    memcpy(n->id, id, 20);
-    memcpy(&n->ss, sa, salen);
-    n->sslen = salen;
-    n->time = confirm ? now.tv_sec : 0;
-    n->reply_time = confirm >= 2 ? now.tv_sec : 0;
-    n->next = b->nodes;
-    b->nodes = n;
-    b->count++;
+    i = b->count++;
+    memcpy(b->ids[i], id, 20);
+    n = &b->nodes[i];
+    memset(n, 0, sizeof(struct node));
+    n->addr = *a;
+    n->time = confirm ? now : 0;
+    n->reply_time = confirm >= 2 ? now : 0;
     if(confirm == 2)
-        add_search_node(id, sa, salen);
+        add_search_node(id, a);
     return n;
 }
 
 /* Called periodically to purge known-bad nodes.  Note that we're very
    conservative here: broken nodes in the table don't do much harm, we'll
-   recover as soon as we find better ones. */
+   recover as soon as we find better ones.  Returns the number of nodes
+   examined. */
 static int
-expire_buckets(struct bucket *b)
+expire_bucket(struct bucket *b)
 {
-    while(b) {
-        struct node *n, *p;
-        int changed = 0;
+    int i = 0, changed = 0, count = b->count;
 
-        while(b->nodes && b->nodes->pinged >= 4) {
-            n = b->nodes;
-            b->nodes = n->next;
-            b->count--;
+    while(i < b->count) {
+        if(b->nodes[i].pinged >= 4) {
+            bucket_remove(b, i);
             changed = 1;
-            free(n);
-        }
-
-        p = b->nodes;
-        while(p) {
-            while(p->next && p->next->pinged >= 4) {
-                n = p->next;
-                p->next = n->next;
-                b->count--;
-                changed = 1;
-                free(n);
-            }
-            p = p->next;
+        } else {
+            i++;
         }
+    }
 
-        if(changed)
-            send_cached_ping(b);
+    if(changed)
+        send_cached_ping(b);
 
-        b = b->next;
-    }
-    expire_stuff_time = now.tv_sec + 120 + random() % 240;
-    return 1;
+    return count;
 }
 
 /* While a search is in progress, we don't necessarily keep the nodes being
@@ -1023,29 +1771,218 @@ expire_buckets(struct bucket *b)
 static struct search *
 find_search(unsigned short tid, int af)
 {
-    struct search *sr = searches;
+    struct search *sr = search_by_tid[tid % SEARCH_HASH_SIZE];
     while(sr) {
         if(sr->tid == tid && sr->af == af)
             return sr;
-        sr = sr->next;
+        sr = sr->tid_next;
+    }
+    return NULL;
+}
+
+static struct search *
+find_search_by_id(const unsigned char *id, int af)
+{
+    struct search *sr = search_by_id[id_hash(id) % SEARCH_HASH_SIZE];
+    while(sr) {
+        if(sr->af == af && id_cmp(sr->id, id) == 0)
+            return sr;
+        sr = sr->id_next;
     }
     return NULL;
 }
 
+/* Must be called after setting the tid and the id of a search. */
+static void
+hash_search(struct search *sr)
+{
+    struct search **p;
+    p = &search_by_tid[sr->tid % SEARCH_HASH_SIZE];
+    sr->tid_next = *p;
+    *p = sr;
+    p = &search_by_id[id_hash(sr->id) % SEARCH_HASH_SIZE];
+    sr->id_next = *p;
+    *p = sr;
+}
+
+static void
+unhash_search(struct search *sr)
+{
+    struct search **p;
+    p = &search_by_tid[sr->tid % SEARCH_HASH_SIZE];
+    while(*p != sr)
+        p = &(*p)->tid_next;
+    *p = sr->tid_next;
+    p = &search_by_id[id_hash(sr->id) % SEARCH_HASH_SIZE];
+    while(*p != sr)
+        p = &(*p)->id_next;
+    *p = sr->id_next;
+}
+
+static void
+link_done_search(struct search *sr)
+{
+    sr->done_next = NULL;
+    sr->done_prev = done_searches_last;
+    if(done_searches_last)
+        done_searches_last->done_next = sr;
+    else
+        done_searches = sr;
+    done_searches_last = sr;
+}
+
+static void
+unlink_done_search(struct search *sr)
+{
+    if(sr->done_prev)
+        sr->done_prev->done_next = sr->done_next;
+    else
+        done_searches = sr->done_next;
+    if(sr->done_next)
+        sr->done_next->done_prev = sr->done_prev;
+    else
+        done_searches_last = sr->done_prev;
+    sr->done_prev = sr->done_next = NULL;
+}
+
+/* Must be called whenever a search starts or completes, and whenever its
+   set of nodes changes.  A search in progress that still has room for
+   nodes is hungry, and is offered every node we hear from; the others
+   have nothing to gain from them. */
+static void
+index_search(struct search *sr)
+{
+    int hungry = !sr->done && sr->numnodes < SEARCH_NODES;
+
+    if(hungry == sr->hungry)
+        return;
+
+    if(hungry) {
+        sr->hungry_prev = NULL;
+        sr->hungry_next = hungry_searches;
+        if(hungry_searches)
+            hungry_searches->hungry_prev = sr;
+        hungry_searches = sr;
+    } else {
+        if(sr->hungry_prev)
+            sr->hungry_prev->hungry_next = sr->hungry_next;
+        else
+            hungry_searches = sr->hungry_next;
+        if(sr->hungry_next)
+            sr->hungry_next->hungry_prev = sr->hungry_prev;
+        sr->hungry_prev = sr->hungry_next = NULL;
+    }
+
+    sr->hungry = hungry;
+}
+
+static void
+heap_set(int i, struct search *sr)
+{
+    search_heap[i] = sr;
+    sr->heap_index = i;
+}
+
+static void
+sift_up(int i)
+{
+    struct search *sr = search_heap[i];
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(search_heap[parent]->next_step <= sr->next_step)
+            break;
+        heap_set(i, search_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, sr);
+}
+
+static void
+sift_down(int i)
+{
+    struct search *sr = search_heap[i];
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= search_heap_size)
+            break;
+        if(child + 1 < search_heap_size &&
+           search_heap[child + 1]->next_step < search_heap[child]->next_step)
+            child++;
+        if(sr->next_step <= search_heap[child]->next_step)
+            break;
+        heap_set(i, search_heap[child]);
+        i = child;
+    }
+    heap_set(i, sr);
+}
+
+/* The time at which the last request sent to a search node times out.
+   This is in the past for nodes that we haven't queried yet. */
+static dht_time_t
+search_node_deadline(const struct search_node *n)
+{
+    return n->request_time + rtt_timeout(&n->rtt, n->pinged);
+}
+
+/* Schedule the next step of a search in progress.  Search_step has
+   nothing to do until one of the outstanding requests times out; if
+   there are none, we look again after DHT_SEARCH_RETRANSMIT, with a
+   little jitter to avoid stepping searches started together in
+   lockstep. */
+static void
+schedule_search(struct search *sr)
+{
+    dht_time_t next;
+    int i;
+
+    next = sr->step_time + DHT_SEARCH_RETRANSMIT +
+        random() % (DHT_SEARCH_RETRANSMIT / 10 + 1);
+    for(i = 0; i < sr->numnodes; i++) {
+        struct search_node *n = &sr->nodes[i];
+        if(n->request_time > 0 && n->pinged < 3) {
+            dht_time_t deadline = search_node_deadline(n);
+            if(deadline > now && deadline < next)
+                next = deadline;
+        }
+    }
+    sr->next_step = next + 1;
+    if(sr->heap_index < 0)
+        heap_set(search_heap_size++, sr);
+    sift_up(sr->heap_index);
+    sift_down(sr->heap_index);
+}
+
+static void
+unschedule_search(struct search *sr)
+{
+    int i = sr->heap_index;
+
+    if(i < 0)
+        return;
+
+    sr->heap_index = -1;
+    search_heap_size--;
+    if(i < search_heap_size) {
+        heap_set(i, search_heap[search_heap_size]);
+        sift_up(i);
+        sift_down(search_heap[i]->heap_index);
+    }
+}
+
 /* A search contains a list of nodes, sorted by decreasing distance to the
    target.  We just got a new candidate, insert it at the right spot or
    discard it. */
 
 static struct search_node*
 insert_search_node(const unsigned char *id,
-                   const struct sockaddr *sa, int salen,
+                   const struct address *a,
                    struct search *sr, int replied,
-                   unsigned char *token, int token_len)
+                   const unsigned char *token, int token_len)
 {
     struct search_node *n;
     int i, j;
 
-    if(sa->sa_family != sr->af) {
+    if(a->af != sr->af) {
         debugf("Attempted to insert node in the wrong family.\n");
         return NULL;
     }
@@ -1074,13 +2011,19 @@ insert_search_node(const unsigned char *id,
     memset(n, 0, sizeof(struct search_node));
     memcpy(n->id, id, 20);
 
+    if(i < 8)
+        sr->stable = 0;
+    index_search(sr);
+
 found:
-    memcpy(&n->ss, sa, salen);
-    n->sslen = salen;
+    n->addr = *a;
 
     if(replied) {
+        /* Karn's rule: only sample unambiguous replies. */
+        if(n->pinged == 1 && n->request_time > 0)
+            rtt_sample(&n->rtt, now - n->request_time);
         n->replied = 1;
-        n->reply_time = now.tv_sec;
+        n->reply_time = now;
         n->request_time = 0;
         n->pinged = 0;
     }
@@ -1090,47 +2033,284 @@ found:
         } else {
             memcpy(n->token, token, token_len);
             n->token_len = token_len;
+            n->token_time = now;
         }
     }
 
     return n;
 }
 
+/* Report an event about a search to the callback it was queued with by
+   dht_search_many if any, otherwise to the one passed to dht_periodic
+   unless it merely refreshes the cache, and to the closures that joined
+   it.  These are forgotten once the search is done. */
 static void
-flush_search_node(struct search_node *n, struct search *sr)
+search_event(struct search *sr, int event, const void *data, size_t data_len,
+             dht_callback_t *callback, void *closure)
 {
-    int i = n - sr->nodes, j;
-    for(j = i; j < sr->numnodes - 1; j++)
-        sr->nodes[j] = sr->nodes[j + 1];
-    sr->numnodes--;
+    struct search_waiter *waiters = sr->waiters;
+    int numwaiters = sr->numwaiters, i;
+
+    /* The callback may restart the search. */
+    if(event == DHT_EVENT_SEARCH_DONE || event == DHT_EVENT_SEARCH_DONE6) {
+        sr->waiters = NULL;
+        sr->numwaiters = 0;
+    }
+
+    if(sr->callback)
+        (*sr->callback)(sr->closure, event, sr->id, data, data_len);
+    else if(callback && !sr->quiet)
+        (*callback)(closure, event, sr->id, data, data_len);
+
+    for(i = 0; i < numwaiters; i++) {
+        struct search_waiter *w = &waiters[i];
+        if(w->callback)
+            (*w->callback)(w->closure, event, sr->id, data, data_len);
+        else if(callback)
+            (*callback)(closure, event, sr->id, data, data_len);
+    }
+
+    if(waiters != sr->waiters)
+        free(waiters);
+}
+
+/* Have the events of sr from now on, up to its completion, also reported
+   to callback with closure. */
+static int
+search_join(struct search *sr, dht_callback_t *callback, void *closure)
+{
+    struct search_waiter *waiters;
+
+    /* It already gets them. */
+    if(!sr->quiet && sr->callback == callback && sr->closure == closure)
+        return 0;
+
+    waiters = realloc(sr->waiters,
+                      (sr->numwaiters + 1) * sizeof(struct search_waiter));
+    if(waiters == NULL)
+        return -1;
+    waiters[sr->numwaiters].callback = callback;
+    waiters[sr->numwaiters].closure = closure;
+    sr->waiters = waiters;
+    sr->numwaiters++;
+    return 0;
 }
 
 static void
-expire_searches(dht_callback_t *callback, void *closure)
+search_done_event(struct search *sr, dht_callback_t *callback, void *closure)
 {
-    struct search *sr = searches, *previous = NULL;
+    int reason = sr->reason;
+    search_event(sr,
+                 sr->af == AF_INET ?
+                 DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
+                 &reason, sizeof(reason), callback, closure);
+}
 
-    while(sr) {
+/* Record that the peer in record has been reported for sr; returns 0 if
+   it already had been.  The set holds keyed hashes rather than records,
+   so two peers are confused with probability 2^-32; the odd peer lost
+   that way will be found by the next search.  Beyond DHT_MAX_PEERS peers,
+   we stop recording and report everything. */
+static int
+search_new_peer(struct search *sr, const unsigned char *record, int len)
+{
+    unsigned h = peer_hash(record, len), mask;
+    int i;
+
+    /* 0 marks an empty slot. */
+    if(h == 0)
+        h = 1;
+
+    if(sr->peer_set_size > 0) {
+        mask = sr->peer_set_size - 1;
+        for(i = h & mask; sr->peer_set[i] != 0; i = (i + 1) & mask) {
+            if(sr->peer_set[i] == h) {
+                sr->duplicates++;
+                return 0;
+            }
+        }
+    }
+
+    if(sr->numpeers >= DHT_MAX_PEERS)
+        return 1;
+
+    if(2 * (sr->numpeers + 1) > sr->peer_set_size) {
+        int size = sr->peer_set_size > 0 ? 2 * sr->peer_set_size : 64;
+        unsigned *set = calloc(size, sizeof(unsigned));
+        int j;
+        /* Better twice than never. */
+        if(set == NULL)
+            return 1;
+        for(j = 0; j < sr->peer_set_size; j++) {
+            unsigned g = sr->peer_set[j];
+            if(g == 0)
+                continue;
+            for(i = g & (size - 1); set[i] != 0; i = (i + 1) & (size - 1))
+                ;
+            set[i] = g;
+        }
+        free(sr->peer_set);
+        sr->peer_set = set;
+        sr->peer_set_size = size;
+    }
+
+    mask = sr->peer_set_size - 1;
+    for(i = h & mask; sr->peer_set[i] != 0; i = (i + 1) & mask)
+        ;
+    sr->peer_set[i] = h;
+    sr->numpeers++;
+    return 1;
+}
+
+/* Drop from the len bytes of values, records of size bytes each, the
+   peers already reported for sr.  Returns the remaining length. */
+static int
+search_filter_values(struct search *sr, unsigned char *values, int len,
+                     int size)
+{
+    int i, j = 0;
+
+    for(i = 0; i + size <= len; i += size) {
+        if(search_new_peer(sr, values + i, size)) {
+            if(j != i)
+                memmove(values + j, values + i, size);
+            j += size;
+        }
+    }
+    return j;
+}
+
+/* Remember the len bytes of new values of a lookup in progress, so that
+   they can answer later searches for the same target. */
+static void
+cache_found(struct search *sr, const unsigned char *values, int len)
+{
+    int size = sr->af == AF_INET ? 6 : 18;
+
+    if(cache_ttl <= 0 || sr->done || len <= 0)
+        return;
+
+    if(sr->found == NULL) {
+        sr->found = malloc(DHT_CACHE_PEERS * size);
+        if(sr->found == NULL)
+            return;
+    }
+
+    len = MIN(len, DHT_CACHE_PEERS * size - sr->found_len);
+    memcpy(sr->found + sr->found_len, values, len);
+    sr->found_len += len;
+}
+
+static void
+flush_search_node(struct search_node *n, struct search *sr)
+{
+    int i = n - sr->nodes, j;
+    for(j = i; j < sr->numnodes - 1; j++)
+        sr->nodes[j] = sr->nodes[j + 1];
+    sr->numnodes--;
+    index_search(sr);
+}
+
+/* Prepare sr for a new lookup of its target, starting from the nodes it
+   already knows. */
+static void
+reset_lookup(struct search *sr)
+{
+    int i;
+
+ again:
+    for(i = 0; i < sr->numnodes; i++) {
+        struct search_node *n;
+        n = &sr->nodes[i];
+        /* Discard any doubtful nodes. */
+        if(n->pinged >= 3 || n->reply_time < now - 2 * 60 * 60 * 1000) {
+            flush_search_node(n, sr);
+            goto again;
+        }
+        n->pinged = 0;
+        n->token_len = 0;
+        n->replied = 0;
+        n->acked = 0;
+    }
+
+    sr->window = MIN(MAX(search_window, search_window_min), search_window_max);
+    sr->stable = 0;
+    sr->queries = 0;
+    sr->start_time = now;
+    sr->reason = 0;
+    sr->reannounce = 0;
+}
+
+/* Whether the closest live nodes of sr, the ones we'd announce to, all
+   gave us tokens recently enough that we needn't ask them again. */
+static int
+search_tokens_fresh(struct search *sr)
+{
+    int i, j = 0;
+
+    for(i = 0; i < sr->numnodes && j < 8; i++) {
+        struct search_node *n = &sr->nodes[i];
+        if(n->pinged >= 3)
+            continue;
+        if(!n->replied || n->token_len == 0 ||
+           n->token_time < now - DHT_TOKEN_LIFETIME)
+            return 0;
+        j++;
+    }
+    return j > 0;
+}
+
+static void
+free_search(struct search *sr)
+{
+    free(sr->peer_set);
+    free(sr->found);
+    free(sr->cache);
+    free(sr->waiters);
+    free(sr);
+}
+
+static void
+expire_searches(dht_callback_t *callback, void *closure)
+{
+    struct search *sr = searches, *previous = NULL, *expired = NULL;
+
+    while(sr) {
         struct search *next = sr->next;
-        if(sr->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
+        if(sr->step_time < now - DHT_SEARCH_EXPIRE_TIME) {
             if(previous)
                 previous->next = next;
             else
                 searches = next;
             numsearches--;
-            if (!sr->done) {
-                if(callback)
-                    (*callback)(closure,
-                                sr->af == AF_INET ?
-                                DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
-                                sr->id, NULL, 0);
+            unhash_search(sr);
+            unschedule_search(sr);
+            if(sr->done) {
+                unlink_done_search(sr);
+                free_search(sr);
+            } else {
+                sr->done = 1;
+                index_search(sr);
+                sr->reason = DHT_SEARCH_EXHAUSTED;
+                if(sr->announce)
+                    announce_finished(sr);
+                /* The callback may start new searches, so report these
+                   once we're done with the list. */
+                sr->next = expired;
+                expired = sr;
             }
-            free(sr);
         } else {
             previous = sr;
         }
         sr = next;
     }
+
+    while(expired) {
+        sr = expired;
+        expired = sr->next;
+        search_done_event(sr, callback, closure);
+        free_search(sr);
+    }
 }
 
 /* This must always return 0 or 1, never -1, not even on failure (see below). */
@@ -1138,46 +2318,92 @@ static int
 search_send_get_peers(struct search *sr, struct search_node *n)
 {
     struct node *node;
+    struct bucket *b;
     unsigned char tid[4];
 
-    if(n == NULL) {
-        int i;
-        for(i = 0; i < sr->numnodes; i++) {
-            if(sr->nodes[i].pinged < 3 && !sr->nodes[i].replied &&
-               sr->nodes[i].request_time < now.tv_sec - DHT_SEARCH_RETRANSMIT)
-                n = &sr->nodes[i];
-        }
-    }
-
-    if(!n || n->pinged >= 3 || n->replied ||
-       n->request_time >= now.tv_sec - DHT_SEARCH_RETRANSMIT)
+    if(n->pinged >= 3 || n->replied || search_node_deadline(n) > now ||
+       sr->queries >= search_max_queries)
         return 0;
 
+    /* A retransmission means that the previous request timed out: we're
+       probably asking too many dead or overloaded nodes at once. */
+    if(n->pinged > 0)
+        sr->window = MAX(sr->window / 2, search_window_min);
+
+    /* If the node happens to be in our main routing table, mark it
+       as pinged, and start from its round-trip time if we don't have
+       our own measurement yet. */
+    node = find_node(n->id, n->addr.af, &b);
+    if(node) {
+        if(n->rtt.srtt == 0)
+            n->rtt = node->rtt;
+        pinged(node, b);
+    }
+
     debugf("Sending get_peers.\n");
     make_tid(tid, "gp", sr->tid);
-    send_get_peers((struct sockaddr*)&n->ss, n->sslen, tid, 4, sr->id, -1,
-                   n->reply_time >= now.tv_sec - DHT_SEARCH_RETRANSMIT);
+    send_get_peers(&n->addr, tid, 4, sr->id, -1,
+                   n->reply_time >= now - DHT_SEARCH_RETRANSMIT);
+    sr->queries++;
     n->pinged++;
-    n->request_time = now.tv_sec;
-    /* If the node happens to be in our main routing table, mark it
-       as pinged. */
-    node = find_node(n->id, n->ss.ss_family);
-    if(node) pinged(node, NULL);
+    n->request_time = now;
+    if(sr->heap_index >= 0 && search_node_deadline(n) < sr->next_step)
+        schedule_search(sr);
     return 1;
 }
 
-/* Insert a new node into any incomplete search. */
+/* The number of get_peers requests of a search that are still awaiting
+   a reply and haven't timed out yet. */
+static int
+search_inflight(struct search *sr)
+{
+    int i, count = 0;
+    for(i = 0; i < sr->numnodes; i++) {
+        struct search_node *n = &sr->nodes[i];
+        if(n->pinged > 0 && n->pinged < 3 && !n->replied &&
+           search_node_deadline(n) > now)
+            count++;
+    }
+    return count;
+}
+
+/* Send requests to the closest nodes that need one, each node being
+   retransmitted to when its own timeout expires, until sr->window
+   requests are outstanding.  The window grows by one whenever a reply
+   brings us closer to the target, and is halved on timeouts (see
+   search_send_get_peers), much like a TCP congestion window. */
 static void
-add_search_node(const unsigned char *id, const struct sockaddr *sa, int salen)
+search_fill_window(struct search *sr)
 {
-    struct search *sr;
-    for(sr = searches; sr; sr = sr->next) {
-        if(sr->af == sa->sa_family && sr->numnodes < SEARCH_NODES) {
-            struct search_node *n =
-                insert_search_node(id, sa, salen, sr, 0, NULL, 0);
-            if(n)
-                search_send_get_peers(sr, n);
-        }
+    int i, j;
+
+    j = search_inflight(sr);
+    for(i = 0; i < sr->numnodes && j < sr->window; i++)
+        j += search_send_get_peers(sr, &sr->nodes[i]);
+}
+
+static void
+offer_search_node(const unsigned char *id, const struct address *a,
+                  struct search *sr)
+{
+    struct search_node *n = insert_search_node(id, a, sr, 0, NULL, 0);
+    if(n && n->pinged == 0 && !n->replied &&
+       search_inflight(sr) < sr->window)
+        search_send_get_peers(sr, n);
+}
+
+/* Insert a new node into any search in progress that still has room
+   for it. */
+static void
+add_search_node(const unsigned char *id, const struct address *a)
+{
+    struct search *sr, *next;
+
+    for(sr = hungry_searches; sr; sr = next) {
+        /* Inserting may fill up the search. */
+        next = sr->hungry_next;
+        if(sr->af == a->af)
+            offer_search_node(id, a, sr);
     }
 }
 
@@ -1187,30 +2413,45 @@ static void
 search_step(struct search *sr, dht_callback_t *callback, void *closure)
 {
     int i, j;
-    int all_done = 1;
 
-    /* Check if the first 8 live nodes have replied. */
-    j = 0;
-    for(i = 0; i < sr->numnodes && j < 8; i++) {
-        struct search_node *n = &sr->nodes[i];
-        if(n->pinged >= 3)
-            continue;
-        if(!n->replied) {
-            all_done = 0;
-            break;
+    if(sr->reason == 0) {
+        int all_done = 1, closest_replied = 0;
+
+        /* Check if the first 8 live nodes have replied. */
+        j = 0;
+        for(i = 0; i < sr->numnodes && j < 8; i++) {
+            struct search_node *n = &sr->nodes[i];
+            if(n->pinged >= 3)
+                continue;
+            if(!n->replied) {
+                all_done = 0;
+                break;
+            }
+            if(j == 0)
+                closest_replied = 1;
+            j++;
         }
-        j++;
+
+        /* Don't wait for slow nodes once the closest ones are known. */
+        if(all_done ||
+           (closest_replied && sr->stable >= search_stable_replies))
+            sr->reason = DHT_SEARCH_CONVERGED;
+        else if((sr->queries >= search_max_queries &&
+                 search_inflight(sr) == 0) ||
+                now - sr->start_time >= search_max_time)
+            sr->reason = DHT_SEARCH_EXHAUSTED;
     }
 
-    if(all_done) {
+    if(sr->reason) {
         if(sr->port == 0) {
             goto done;
         } else {
-            int all_acked = 1;
+            int all_acked = 1, acked = 0;
             j = 0;
             for(i = 0; i < sr->numnodes && j < 8; i++) {
                 struct search_node *n = &sr->nodes[i];
                 struct node *node;
+                struct bucket *b;
                 unsigned char tid[4];
                 if(n->pinged >= 3)
                     continue;
@@ -1220,73 +2461,81 @@ search_step(struct search *sr, dht_callback_t *callback, void *closure)
                    a positive reply is just as good --, let's deal with it. */
                 if(n->token_len == 0)
                     n->acked = 1;
+                else if(n->acked)
+                    acked++;
                 if(!n->acked) {
                     all_acked = 0;
+                    if(search_node_deadline(n) > now) {
+                        /* Still waiting for this one. */
+                        j++;
+                        continue;
+                    }
                     debugf("Sending announce_peer.\n");
                     make_tid(tid, "ap", sr->tid);
-                    send_announce_peer((struct sockaddr*)&n->ss,
-                                       sizeof(struct sockaddr_storage),
-                                       tid, 4, sr->id, sr->port,
+                    send_announce_peer(&n->addr, tid, 4, sr->id, sr->port,
                                        n->token, n->token_len,
-                                       n->reply_time >= now.tv_sec - 15);
+                                       n->reply_time >= now - 15 * 1000);
                     n->pinged++;
-                    n->request_time = now.tv_sec;
-                    node = find_node(n->id, n->ss.ss_family);
-                    if(node) pinged(node, NULL);
+                    n->request_time = now;
+                    node = find_node(n->id, n->addr.af, &b);
+                    if(node) pinged(node, b);
                 }
                 j++;
             }
-            if(all_acked)
-                goto done;
+            if(all_acked) {
+                if(!sr->reannounce || acked > 0)
+                    goto done;
+                /* Nobody answered our announce with old tokens. */
+                debugf("Re-announce failed, looking up.\n");
+                reset_lookup(sr);
+                search_fill_window(sr);
+            }
         }
-        sr->step_time = now.tv_sec;
+        sr->step_time = now;
         return;
     }
 
-    if(sr->step_time + DHT_SEARCH_RETRANSMIT >= now.tv_sec)
-        return;
-
-    j = 0;
-    for(i = 0; i < sr->numnodes; i++) {
-        j += search_send_get_peers(sr, &sr->nodes[i]);
-        if(j >= DHT_INFLIGHT_QUERIES)
-            break;
-    }
-    sr->step_time = now.tv_sec;
+    search_fill_window(sr);
+    sr->step_time = now;
     return;
 
  done:
     sr->done = 1;
-    if(callback)
-        (*callback)(closure,
-                    sr->af == AF_INET ?
-                    DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
-                    sr->id, NULL, 0);
-    sr->step_time = now.tv_sec;
+    sr->step_time = now;
+    /* A re-announce found no peers. */
+    if(cache_ttl > 0 && !sr->reannounce) {
+        /* What this lookup found replaces what the previous one did;
+           swap the buffers so that both are reused. */
+        unsigned char *cache = sr->cache;
+        sr->cache = sr->found;
+        sr->cache_len = sr->found_len;
+        sr->found = cache;
+        sr->found_len = 0;
+        sr->cache_time = now;
+        sr->cache_reason = sr->reason;
+    }
+    if(sr->announce)
+        announce_finished(sr);
+    index_search(sr);
+    unschedule_search(sr);
+    link_done_search(sr);
+    search_done_event(sr, callback, closure);
 }
 
 static struct search *
 new_search(void)
 {
-    struct search *sr, *oldest = NULL;
-
-    /* Find the oldest done search */
-    sr = searches;
-    while(sr) {
-        if(sr->done &&
-           (oldest == NULL || oldest->step_time > sr->step_time))
-            oldest = sr;
-        sr = sr->next;
-    }
+    struct search *sr, *oldest = done_searches;
 
-    /* The oldest slot is expired. */
-    if(oldest && oldest->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
-        return oldest;
+    /* The oldest done slot is expired. */
+    if(oldest && oldest->step_time < now - DHT_SEARCH_EXPIRE_TIME)
+        goto reuse;
 
-    /* Allocate a new slot. */
+    /* Allocate a new slot.  The caller hashes it. */
     if(numsearches < DHT_MAX_SEARCHES) {
         sr = calloc(1, sizeof(struct search));
         if(sr != NULL) {
+            sr->heap_index = -1;
             sr->next = searches;
             searches = sr;
             numsearches++;
@@ -1295,24 +2544,245 @@ new_search(void)
     }
 
     /* Return oldest slot if it's done. */
-    if(oldest && oldest->done)
-        return oldest;
+    if(oldest)
+        goto reuse;
 
     /* No available slots found, return NULL. */
     return NULL;
+
+ reuse:
+    unlink_done_search(oldest);
+    unhash_search(oldest);
+    if(oldest->cache_time > 0 && now - oldest->cache_time < cache_ttl)
+        cache_evictions++;
+    /* The buffers are sized for the address family. */
+    free(oldest->found);
+    free(oldest->cache);
+    oldest->found = oldest->cache = NULL;
+    oldest->found_len = oldest->cache_len = 0;
+    oldest->cache_time = 0;
+    return oldest;
 }
 
 /* Insert the contents of a bucket into a search structure. */
 static void
 insert_search_bucket(struct bucket *b, struct search *sr)
 {
-    struct node *n;
-    n = b->nodes;
-    while(n) {
-        insert_search_node(n->id, (struct sockaddr*)&n->ss, n->sslen,
-                           sr, 0, NULL, 0);
-        n = n->next;
+    int i;
+    for(i = 0; i < b->count; i++) {
+        struct node *n = &b->nodes[i];
+        insert_search_node(b->ids[i], &n->addr, sr, 0, NULL, 0);
+    }
+}
+
+/* Pass the peers in pl not yet reported for sr (if not NULL) to the
+   callback, as many at a time as would fit in a reply. */
+static void
+local_values(struct search *sr, const unsigned char *id,
+             const struct peer_list *pl, int event,
+             dht_callback_t *callback, void *closure)
+{
+    unsigned char values[PARSE_VALUES_LEN];
+    int reclen = event == DHT_EVENT_VALUES ? PEER_LEN : PEER6_LEN;
+    int size = event == DHT_EVENT_VALUES ? 6 : 18;
+    int i, len = 0;
+
+    for(i = 0; i < pl->numpeers; i++) {
+        /* Skip the "6:" or "18:" prefix of each record. */
+        const unsigned char *p = pl->records + i * reclen + reclen - size;
+        if(sr && !search_new_peer(sr, p, size))
+            continue;
+        memcpy(values + len, p, size);
+        len += size;
+        if(len + size > PARSE_VALUES_LEN) {
+            (*callback)(closure, event, id, values, len);
+            len = 0;
+        }
     }
+    if(len > 0)
+        (*callback)(closure, event, id, values, len);
+}
+
+/* Try to answer a search locally.  In a fully grown DHT this is very
+   unlikely, but people are running modified versions of this code in
+   private DHTs with very few nodes.  What's wrong with flooding? */
+static void
+search_local(struct search *sr, const unsigned char *id,
+             dht_callback_t *callback, void *closure)
+{
+    struct storage *st = find_storage(id);
+
+    if(st == NULL)
+        return;
+
+    debugf("Found local data (%d+%d peers).\n",
+           st->peers.numpeers, st->peers6.numpeers);
+
+    local_values(sr, id, &st->peers, DHT_EVENT_VALUES, callback, closure);
+    local_values(sr, id, &st->peers6, DHT_EVENT_VALUES6, callback, closure);
+}
+
+/* Set up a search for id, or restart the existing one, and seed it with
+   the nodes of bucket b and its neighbours.  Sets *duplicate_return if
+   a search for id was already in progress. */
+static struct search *
+start_search(const unsigned char *id, int port, int af, struct bucket *b,
+             int *duplicate_return)
+{
+    struct search *sr;
+    int reannounce = 0;
+
+    sr = find_search_by_id(id, af);
+
+    *duplicate_return = sr && !sr->done;
+
+    if(sr) {
+        /* We're reusing data from an old search.  Reusing the same tid
+           means that we can merge replies for both searches.  If it
+           completed recently, we can even announce straight away. */
+        if(sr->done) {
+            reannounce = port != 0 && search_tokens_fresh(sr);
+            unlink_done_search(sr);
+            sr->callback = NULL;
+            sr->closure = NULL;
+        }
+        sr->done = 0;
+    } else {
+        sr = new_search();
+        if(sr == NULL) {
+            errno = ENOSPC;
+            return NULL;
+        }
+        sr->af = af;
+        sr->tid = search_id++;
+        sr->step_time = 0;
+        memcpy(sr->id, id, 20);
+        sr->done = 0;
+        sr->numnodes = 0;
+        sr->callback = NULL;
+        sr->closure = NULL;
+        hash_search(sr);
+    }
+
+    sr->port = port;
+    sr->quiet = 0;
+    if(reannounce) {
+        int i;
+        for(i = 0; i < sr->numnodes; i++) {
+            sr->nodes[i].pinged = 0;
+            sr->nodes[i].acked = 0;
+        }
+        sr->start_time = now;
+        sr->reason = DHT_SEARCH_CONVERGED;
+        sr->reannounce = 1;
+    } else {
+        reset_lookup(sr);
+    }
+    /* A new lookup reports every peer it finds, even if an earlier one
+       for the same target already did. */
+    if(!*duplicate_return) {
+        if(sr->peer_set_size > 0)
+            memset(sr->peer_set, 0, sr->peer_set_size * sizeof(unsigned));
+        sr->numpeers = 0;
+        sr->duplicates = 0;
+        sr->found_len = 0;
+    }
+
+    /* New nodes would only come between us and the ones we have tokens
+       from. */
+    if(!reannounce) {
+        insert_search_bucket(b, sr);
+
+        if(sr->numnodes < SEARCH_NODES) {
+            struct bucket *p = previous_bucket(b);
+            if(b->next)
+                insert_search_bucket(b->next, sr);
+            if(p)
+                insert_search_bucket(p, sr);
+        }
+        if(sr->numnodes < SEARCH_NODES)
+            insert_search_bucket(find_bucket(myid, af), sr);
+    }
+
+    index_search(sr);
+    return sr;
+}
+
+/* Whether a recent lookup for id completed, in which case its results
+   answer a search for id without another lookup.  Sets *refresh_return
+   if these results are due for a refresh. */
+static int
+cache_lookup(const unsigned char *id, int af, int *refresh_return)
+{
+    struct search *sr;
+
+    *refresh_return = 0;
+
+    if(cache_ttl <= 0)
+        return 0;
+
+    sr = find_search_by_id(id, af);
+    if(sr == NULL || sr->cache_time == 0 ||
+       now - sr->cache_time >= cache_ttl) {
+        cache_misses++;
+        return 0;
+    }
+
+    cache_hits++;
+    /* Unless a refresh is already in progress. */
+    *refresh_return = sr->done && cache_refresh > 0 &&
+        now - sr->cache_time >= cache_refresh;
+    return 1;
+}
+
+/* Pass the peers found by a recent lookup for id to the callback,
+   followed by a DHT_EVENT_SEARCH_DONE event.  Returns 0 if there are no
+   such results any more, which happens if an earlier callback dropped
+   them. */
+static int
+cache_report(const unsigned char *id, int af,
+             dht_callback_t *callback, void *closure)
+{
+    struct search *sr;
+    int reason;
+
+    sr = find_search_by_id(id, af);
+    if(cache_ttl <= 0 || sr == NULL || sr->cache_time == 0 ||
+       now - sr->cache_time >= cache_ttl)
+        return 0;
+
+    if(callback == NULL)
+        return 1;
+
+    reason = sr->cache_reason;
+    search_local(NULL, id, callback, closure);
+    /* The callback may have dropped sr. */
+    sr = find_search_by_id(id, af);
+    if(sr != NULL && sr->cache_len > 0)
+        (*callback)(closure,
+                    af == AF_INET ? DHT_EVENT_VALUES : DHT_EVENT_VALUES6,
+                    id, sr->cache, sr->cache_len);
+    (*callback)(closure,
+                af == AF_INET ? DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
+                id, &reason, sizeof(reason));
+    return 1;
+}
+
+/* Start a lookup for id in the background; it only updates the cached
+   results, the search having already been answered from them. */
+static void
+search_refresh(const unsigned char *id, int af, struct bucket *b)
+{
+    struct search *sr;
+    int duplicate;
+
+    sr = start_search(id, 0, af, b, &duplicate);
+    if(sr == NULL)
+        return;
+    sr->quiet = 1;
+    search_step(sr, NULL, NULL);
+    if(!sr->done)
+        schedule_search(sr);
 }
 
 /* Start a search.  If port is non-zero, perform an announce when the
@@ -1322,230 +2792,787 @@ dht_search(const unsigned char *id, int port, int af,
            dht_callback_t *callback, void *closure)
 {
     struct search *sr;
-    struct storage *st;
     struct bucket *b = find_bucket(id, af);
+    int duplicate, refresh;
 
     if(b == NULL) {
         errno = EAFNOSUPPORT;
         return -1;
     }
 
-    /* Try to answer this search locally.  In a fully grown DHT this
-       is very unlikely, but people are running modified versions of
-       this code in private DHTs with very few nodes.  What's wrong
-       with flooding? */
-    if(callback) {
-        st = find_storage(id);
-        if(st) {
-            unsigned short swapped;
-            unsigned char buf[18];
-            int i;
-
-            debugf("Found local data (%d peers).\n", st->numpeers);
-
-            for(i = 0; i < st->numpeers; i++) {
-                swapped = htons(st->peers[i].port);
-                if(st->peers[i].len == 4) {
-                    memcpy(buf, st->peers[i].ip, 4);
-                    memcpy(buf + 4, &swapped, 2);
-                    (*callback)(closure, DHT_EVENT_VALUES, id,
-                                (void*)buf, 6);
-                } else if(st->peers[i].len == 16) {
-                    memcpy(buf, st->peers[i].ip, 16);
-                    memcpy(buf + 16, &swapped, 2);
-                    (*callback)(closure, DHT_EVENT_VALUES6, id,
-                                (void*)buf, 18);
-                }
-            }
+    /* Announces always need a lookup, for the tokens. */
+    if(port == 0 && cache_lookup(id, af, &refresh)) {
+        cache_report(id, af, callback, closure);
+        /* The callback may have changed the routing table. */
+        if(refresh && (b = find_bucket(id, af)) != NULL)
+            search_refresh(id, af, b);
+        return 0;
+    }
+
+    sr = start_search(id, port, af, b, &duplicate);
+
+    /* Even if we couldn't start a search. */
+    if(callback)
+        search_local(sr, id, callback, closure);
+
+    if(sr == NULL)
+        return -1;
+
+    search_step(sr, callback, closure);
+    if(!sr->done)
+        schedule_search(sr);
+    return duplicate ? 0 : 1;
+}
+
+static int
+pending_search_cmp(const void *a, const void *b)
+{
+    return id_cmp(((const struct pending_search*)a)->id,
+                  ((const struct pending_search*)b)->id);
+}
+
+/* Queue searches for count targets, stored one after the other in ids.
+   Each search reports to callback with its own closure, and starts from
+   dht_periodic, see start_pending_searches. */
+int
+dht_search_many(const unsigned char *ids, int count, int port, int af,
+                 dht_callback_t *callback, void * const *closures)
+{
+    struct pending_search *p;
+    int *hits = NULL;
+    int i, n, numhits, queued;
+
+    if(count < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((af == AF_INET ? buckets : af == AF_INET6 ? buckets6 : NULL) == NULL) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    if(pending_first > 0) {
+        memmove(pending_searches, pending_searches + pending_first,
+                numpending * sizeof(struct pending_search));
+        pending_first = 0;
+    }
+
+    if(numpending + count > maxpending) {
+        int n = MAX(numpending + count, 2 * maxpending);
+        struct pending_search *new_pending;
+        new_pending = realloc(pending_searches,
+                              n * sizeof(struct pending_search));
+        if(new_pending == NULL) {
+            errno = ENOMEM;
+            return -1;
         }
+        pending_searches = new_pending;
+        maxpending = n;
     }
 
-    sr = searches;
-    while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
-            break;
-        sr = sr->next;
+    /* Announces always need a lookup, for the tokens. */
+    if(port == 0 && cache_ttl > 0 && count > 0) {
+        hits = malloc(count * sizeof(int));
+        if(hits == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
     }
 
-    int sr_duplicate = sr && !sr->done;
+    p = pending_searches + numpending;
+    n = numhits = queued = 0;
+    for(i = 0; i < count; i++) {
+        int refresh = 0;
+        if(hits && cache_lookup(ids + 20 * i, af, &refresh)) {
+            hits[numhits++] = i;
+            if(!refresh)
+                continue;
+        }
+        memcpy(p[n].id, ids + 20 * i, 20);
+        p[n].port = port;
+        p[n].af = af;
+        /* Refreshes are queued too, but report nothing. */
+        p[n].callback = refresh ? NULL : callback;
+        p[n].closure = refresh || closures == NULL ? NULL : closures[i];
+        p[n].quiet = refresh;
+        if(!refresh)
+            queued++;
+        n++;
+    }
 
-    if(sr) {
-        /* We're reusing data from an old search.  Reusing the same tid
-           means that we can merge replies for both searches. */
-        int i;
-        sr->done = 0;
-    again:
-        for(i = 0; i < sr->numnodes; i++) {
-            struct search_node *n;
-            n = &sr->nodes[i];
-            /* Discard any doubtful nodes. */
-            if(n->pinged >= 3 || n->reply_time < now.tv_sec - 7200) {
-                flush_search_node(n, sr);
-                goto again;
+    /* Starting the searches in order of target means that consecutive
+       searches are seeded from the same buckets. */
+    qsort(p, n, sizeof(struct pending_search), pending_search_cmp);
+    numpending += n;
+
+    /* Only now that the queue is consistent do we answer from the cache,
+       since the callback may queue more searches, or even call
+       dht_uninit.  Results dropped by an earlier callback are searched
+       for after all. */
+    for(i = 0; i < numhits; i++) {
+        const unsigned char *id = ids + 20 * hits[i];
+        void *closure = closures ? closures[hits[i]] : NULL;
+        if(!cache_report(id, af, callback, closure) &&
+           dht_search_many(id, 1, port, af, callback, &closure) > 0)
+            queued++;
+    }
+    free(hits);
+
+    return queued;
+}
+
+/* Start queued searches, at most search_rate per second and as long as
+   fewer than search_concurrency searches are in progress, so that large
+   batches don't exceed the rate at which other nodes accept our
+   requests.  A target that is already being searched for, for instance
+   because it appears twice in a batch, joins that search instead. */
+static void
+start_pending_searches(dht_callback_t *callback, void *closure)
+{
+    struct bucket *b = NULL;
+
+    while(numpending > 0 && search_heap_size < search_concurrency &&
+          pending_time <= now) {
+        /* The callback may queue more searches. */
+        struct pending_search p = pending_searches[pending_first];
+        struct search *sr;
+        int joined, duplicate;
+
+        sr = find_search_by_id(p.id, p.af);
+        joined = sr && !sr->done;
+        if(joined && p.quiet) {
+            /* It will refresh the cache. */
+            pending_first++;
+            numpending--;
+            continue;
+        }
+        if(joined) {
+            if(search_join(sr, p.callback, p.closure) < 0)
+                break;
+            /* Unless it must be restarted to announce. */
+            if(p.port == 0 || p.port == sr->port) {
+                pending_first++;
+                numpending--;
+                if(p.callback)
+                    search_local(NULL, p.id, p.callback, p.closure);
+                continue;
             }
-            n->pinged = 0;
-            n->token_len = 0;
-            n->replied = 0;
-            n->acked = 0;
         }
+
+        if(b == NULL || b->af != p.af || !in_bucket(p.id, b))
+            b = find_bucket(p.id, p.af);
+
+        if(b != NULL) {
+            sr = start_search(p.id, p.port, p.af, b, &duplicate);
+            /* No free slot, try again later. */
+            if(sr == NULL)
+                break;
+            pending_first++;
+            numpending--;
+            if(!joined) {
+                sr->callback = p.callback;
+                sr->closure = p.closure;
+                sr->quiet = p.quiet;
+            }
+            if(p.callback)
+                search_local(joined ? NULL : sr, p.id,
+                             p.callback, p.closure);
+            search_step(sr, callback, closure);
+            if(!sr->done)
+                schedule_search(sr);
+        } else {
+            pending_first++;
+            numpending--;
+        }
+
+        pending_time = MAX(pending_time, now - 1000) + 1000 / search_rate;
+    }
+
+    if(numpending == 0)
+        pending_first = 0;
+}
+
+/* Registered announces. */
+
+static struct announce *
+find_announce(const unsigned char *id, int af)
+{
+    struct announce *a;
+
+    if(announce_table_size == 0)
+        return NULL;
+
+    a = announce_table[id_hash(id) & (announce_table_size - 1)];
+    while(a) {
+        if(a->af == af && id_cmp(a->id, id) == 0)
+            return a;
+        a = a->hash_next;
+    }
+    return NULL;
+}
+
+static void
+wheel_insert(struct announce *a)
+{
+    /* A time in a slot that has already been run means as soon as
+       possible. */
+    dht_time_t t = MAX(a->time, announce_wheel_time);
+    struct announce **p;
+
+    a->slot = (t / ANNOUNCE_SLOT) % ANNOUNCE_WHEEL_SIZE;
+    p = &announce_wheel[a->slot];
+    a->wheel_prev = NULL;
+    a->wheel_next = *p;
+    if(*p)
+        (*p)->wheel_prev = a;
+    *p = a;
+}
+
+static void
+wheel_remove(struct announce *a)
+{
+    if(a->wheel_prev)
+        a->wheel_prev->wheel_next = a->wheel_next;
+    else
+        announce_wheel[a->slot] = a->wheel_next;
+    if(a->wheel_next)
+        a->wheel_next->wheel_prev = a->wheel_prev;
+    a->wheel_prev = a->wheel_next = NULL;
+}
+
+/* Schedule the next announce of a, after one that succeeded or not. */
+static void
+announce_done(struct announce *a, int ok)
+{
+    if(a->running) {
+        a->running = 0;
+        announce_running--;
+    }
+
+    if(ok) {
+        a->announced = now;
+        a->failures = 0;
+        /* Keep to the schedule, so that announces remain spread out. */
+        a->time = MAX(a->time + announce_interval, now);
     } else {
-        sr = new_search();
-        if(sr == NULL) {
-            errno = ENOSPC;
-            return -1;
+        int shift = MIN(a->failures, 16);
+        a->failures++;
+        a->time = now + MIN((dht_time_t)DHT_ANNOUNCE_RETRY << shift,
+                            announce_interval);
+    }
+    wheel_insert(a);
+}
+
+/* Called when the search for a registered announce completes; it
+   succeeded if any node acked it. */
+static void
+announce_finished(struct search *sr)
+{
+    struct announce *a = sr->announce;
+    int i, ok = 0;
+
+    sr->announce = NULL;
+    for(i = 0; i < sr->numnodes; i++) {
+        if(sr->nodes[i].acked && sr->nodes[i].token_len > 0) {
+            ok = 1;
+            break;
         }
-        sr->af = af;
-        sr->tid = search_id++;
-        sr->step_time = 0;
-        memcpy(sr->id, id, 20);
-        sr->done = 0;
-        sr->numnodes = 0;
     }
+    announce_done(a, ok);
+}
 
-    sr->port = port;
+/* Start the announces that are due, as long as fewer than
+   announce_concurrency are in progress.  A slot is only run once it has
+   ended, so an announce may be up to ANNOUNCE_SLOT late. */
+static void
+run_announces(dht_callback_t *callback, void *closure)
+{
+    while(announce_wheel_time + ANNOUNCE_SLOT <= now) {
+        int slot = (announce_wheel_time / ANNOUNCE_SLOT) % ANNOUNCE_WHEEL_SIZE;
+        struct announce *a = announce_wheel[slot];
+
+        while(a) {
+            struct announce *next = a->wheel_next;
+            /* Otherwise, it's for a later turn of the wheel. */
+            if(a->time < announce_wheel_time + ANNOUNCE_SLOT) {
+                struct bucket *b;
+                struct search *sr = NULL;
+                int duplicate;
+
+                if(announce_running >= announce_concurrency)
+                    return;
+
+                wheel_remove(a);
+                b = find_bucket(a->id, a->af);
+                if(b)
+                    sr = start_search(a->id, a->port, a->af, b, &duplicate);
+                if(sr == NULL) {
+                    /* No free slot, or no routing table for this family. */
+                    announce_done(a, 0);
+                } else {
+                    a->running = 1;
+                    announce_running++;
+                    sr->announce = a;
+                    search_step(sr, callback, closure);
+                    if(!sr->done)
+                        schedule_search(sr);
+                    /* The callback may have unregistered the next one;
+                       those we've started are no longer in the slot. */
+                    next = announce_wheel[slot];
+                }
+            }
+            a = next;
+        }
+        announce_wheel_time += ANNOUNCE_SLOT;
+    }
+}
+
+/* When run_announces next has something to do: the end of the first
+   slot from announce_wheel_time on that holds an announce, or limit if
+   that is later.  The slot may only hold announces for a later turn of
+   the wheel, which costs a useless wakeup at worst. */
+static dht_time_t
+announce_wakeup(dht_time_t limit)
+{
+    int i, slot = (announce_wheel_time / ANNOUNCE_SLOT) % ANNOUNCE_WHEEL_SIZE;
+    dht_time_t t = announce_wheel_time + ANNOUNCE_SLOT;
+
+    for(i = 0; i < ANNOUNCE_WHEEL_SIZE && t < limit; i++) {
+        if(announce_wheel[slot])
+            return t;
+        slot = (slot + 1) % ANNOUNCE_WHEEL_SIZE;
+        t += ANNOUNCE_SLOT;
+    }
+    return limit;
+}
 
-    insert_search_bucket(b, sr);
+int
+dht_announce(const unsigned char *id, int port, int af)
+{
+    struct announce *a;
+    unsigned h;
 
-    if(sr->numnodes < SEARCH_NODES) {
-        struct bucket *p = previous_bucket(b);
-        if(b->next)
-            insert_search_bucket(b->next, sr);
-        if(p)
-            insert_search_bucket(p, sr);
+    if(port <= 0 || port > 0xFFFF || (af != AF_INET && af != AF_INET6)) {
+        errno = EINVAL;
+        return -1;
     }
-    if(sr->numnodes < SEARCH_NODES)
-        insert_search_bucket(find_bucket(myid, af), sr);
 
-    search_step(sr, callback, closure);
-    search_time = now.tv_sec;
-    if(sr_duplicate) {
+    a = find_announce(id, af);
+    if(a) {
+        a->port = port;
         return 0;
+    }
+
+    if(numannounces >= announce_table_size) {
+        int size = announce_table_size > 0 ? 2 * announce_table_size : 64;
+        struct announce **table = calloc(size, sizeof(struct announce*));
+        int i;
+        if(table == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for(i = 0; i < announce_table_size; i++) {
+            while(announce_table[i]) {
+                struct announce *b = announce_table[i];
+                announce_table[i] = b->hash_next;
+                h = id_hash(b->id) & (size - 1);
+                b->hash_next = table[h];
+                table[h] = b;
+            }
+        }
+        free(announce_table);
+        announce_table = table;
+        announce_table_size = size;
+    }
+
+    a = calloc(1, sizeof(struct announce));
+    if(a == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(a->id, id, 20);
+    a->port = port;
+    a->af = af;
+
+    h = id_hash(id) & (announce_table_size - 1);
+    a->hash_next = announce_table[h];
+    announce_table[h] = a;
+    if(numannounces == 0 && announce_running == 0)
+        announce_wheel_time = now - now % ANNOUNCE_SLOT;
+    numannounces++;
+
+    /* Spread the first announces over the interval, so that registering
+       many info hashes at once doesn't cause a burst. */
+    a->time = now + random() % announce_interval;
+    wheel_insert(a);
+    return 1;
+}
+
+int
+dht_unannounce(const unsigned char *id, int af)
+{
+    struct announce **p, *a;
+
+    if(announce_table_size == 0)
+        goto fail;
+
+    p = &announce_table[id_hash(id) & (announce_table_size - 1)];
+    while(*p && ((*p)->af != af || id_cmp((*p)->id, id) != 0))
+        p = &(*p)->hash_next;
+    if(*p == NULL)
+        goto fail;
+
+    a = *p;
+    *p = a->hash_next;
+    if(a->running) {
+        /* Let the search complete on its own. */
+        struct search *sr = find_search_by_id(id, af);
+        if(sr && sr->announce == a)
+            sr->announce = NULL;
+        announce_running--;
     } else {
-        return 1;
+        wheel_remove(a);
     }
+    free(a);
+    numannounces--;
+    return 1;
+
+ fail:
+    errno = ENOENT;
+    return -1;
 }
 
 /* A struct storage stores all the stored peer addresses for a given info
    hash. */
 
+/* Peer addresses are chosen by whoever sends announce_peer, so the hash
+   is keyed with a random value. */
+static inline unsigned
+peer_hash(const unsigned char *record, int len)
+{
+    unsigned h = peer_hash_key;
+    int i;
+    for(i = 0; i < len; i++)
+        h = (h ^ record[i]) * 16777619;
+    return h ^ (h >> 16);
+}
+
+/* Returns the slot holding the given record, or the empty slot where it
+   would go. */
+static int
+peer_slot(const struct peer_list *pl, const unsigned char *record, int len)
+{
+    unsigned mask = pl->index_size - 1;
+    unsigned i = peer_hash(record, len) & mask;
+    int j;
+
+    while((j = pl->index[i]) >= 0) {
+        if(memcmp(pl->records + j * len, record, len) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void
+rebuild_peer_index(struct peer_list *pl, int len)
+{
+    int i;
+    for(i = 0; i < pl->index_size; i++)
+        pl->index[i] = -1;
+    for(i = 0; i < pl->numpeers; i++)
+        pl->index[peer_slot(pl, pl->records + i * len, len)] = i;
+}
+
+static void
+free_peers(struct peer_list *pl)
+{
+    free(pl->records);
+    free(pl->times);
+    free(pl->index);
+    memset(pl, 0, sizeof(struct peer_list));
+}
+
+/* Returns the slot holding id, or the empty slot where it would go. */
+static int
+storage_slot(const unsigned char *id)
+{
+    unsigned mask = storage_index_size - 1;
+    unsigned i = id_hash(id) & mask;
+
+    while(storage_index[i] >= 0 &&
+          id_cmp(storage[storage_index[i]].id, id) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
 static struct storage *
 find_storage(const unsigned char *id)
 {
-    struct storage *st = storage;
+    int i;
 
-    while(st) {
-        if(id_cmp(id, st->id) == 0)
-            break;
-        st = st->next;
+    if(numstorage == 0)
+        return NULL;
+
+    i = storage_index[storage_slot(id)];
+    return i >= 0 ? &storage[i] : NULL;
+}
+
+static int
+resize_storage_index(int size)
+{
+    int *new_index;
+    int i;
+
+    new_index = malloc(size * sizeof(int));
+    if(new_index == NULL)
+        return -1;
+
+    free(storage_index);
+    storage_index = new_index;
+    storage_index_size = size;
+    for(i = 0; i < size; i++)
+        storage_index[i] = -1;
+    for(i = 0; i < numstorage; i++)
+        storage_index[storage_slot(storage[i].id)] = i;
+    return 1;
+}
+
+static struct storage *
+new_storage(const unsigned char *id)
+{
+    struct storage *st;
+
+    if(numstorage >= DHT_MAX_HASHES)
+        return NULL;
+
+    if(numstorage >= maxstorage) {
+        struct storage *new_storage;
+        int n = maxstorage == 0 ? 8 : 2 * maxstorage;
+        n = MIN(n, DHT_MAX_HASHES);
+        new_storage = realloc(storage, n * sizeof(struct storage));
+        if(new_storage == NULL)
+            return NULL;
+        storage = new_storage;
+        maxstorage = n;
+    }
+
+    /* Keep the hash table at most half full. */
+    if(2 * (numstorage + 1) > storage_index_size) {
+        int rc;
+        rc = resize_storage_index(storage_index_size == 0 ?
+                                  16 : 2 * storage_index_size);
+        if(rc < 0)
+            return NULL;
     }
+
+    st = &storage[numstorage];
+    memset(st, 0, sizeof(struct storage));
+    memcpy(st->id, id, 20);
+    storage_index[storage_slot(id)] = numstorage;
+    numstorage++;
     return st;
 }
 
+/* Removes the i-th entry by moving the last one into its place.  Since
+   we use linear probing, removing an entry from the hash table requires
+   moving back any entries that would no longer be reachable. */
+static void
+remove_storage(int i)
+{
+    unsigned mask = storage_index_size - 1;
+    unsigned hole, j, k;
+
+    free_peers(&storage[i].peers);
+    free_peers(&storage[i].peers6);
+
+    hole = storage_slot(storage[i].id);
+    j = hole;
+    while(1) {
+        j = (j + 1) & mask;
+        if(storage_index[j] < 0)
+            break;
+        k = id_hash(storage[storage_index[j]].id) & mask;
+        /* Leave the entry alone if its home slot is in (hole, j]. */
+        if(hole <= j ? (hole < k && k <= j) : (hole < k || k <= j))
+            continue;
+        storage_index[hole] = storage_index[j];
+        hole = j;
+    }
+    storage_index[hole] = -1;
+
+    numstorage--;
+    if(i < numstorage) {
+        storage_index[storage_slot(storage[numstorage].id)] = i;
+        storage[i] = storage[numstorage];
+    }
+}
+
 static int
 storage_store(const unsigned char *id,
-              const struct sockaddr *sa, unsigned short port)
+              const struct address *a, unsigned short port)
 {
-    int i, len;
+    int i, len, slot;
     struct storage *st;
-    unsigned char *ip;
-
-    if(sa->sa_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
-        ip = (unsigned char*)&sin->sin_addr;
-        len = 4;
-    } else if(sa->sa_family == AF_INET6) {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
-        ip = (unsigned char*)&sin6->sin6_addr;
-        len = 16;
+    struct peer_list *pl;
+    unsigned char record[PEER6_LEN];
+    unsigned short swapped;
+
+    swapped = htons(port);
+    if(a->af == AF_INET) {
+        len = PEER_LEN;
+        memcpy(record, "6:", 2);
+        memcpy(record + 2, a->ip, 4);
+    } else if(a->af == AF_INET6) {
+        len = PEER6_LEN;
+        memcpy(record, "18:", 3);
+        memcpy(record + 3, a->ip, 16);
     } else {
         return -1;
     }
+    memcpy(record + len - 2, &swapped, 2);
 
     st = find_storage(id);
 
     if(st == NULL) {
-        if(numstorage >= DHT_MAX_HASHES)
+        st = new_storage(id);
+        if(st == NULL)
             return -1;
-        st = calloc(1, sizeof(struct storage));
-        if(st == NULL) return -1;
-        memcpy(st->id, id, 20);
-        st->next = storage;
-        storage = st;
-        numstorage++;
     }
 
-    for(i = 0; i < st->numpeers; i++) {
-        if(st->peers[i].port == port && st->peers[i].len == len &&
-           memcmp(st->peers[i].ip, ip, len) == 0)
-            break;
+    pl = a->af == AF_INET ? &st->peers : &st->peers6;
+
+    slot = -1;
+    if(pl->index_size > 0) {
+        slot = peer_slot(pl, record, len);
+        i = pl->index[slot];
+        if(i >= 0) {
+            /* Already there, only need to refresh */
+            pl->times[i] = now;
+            return 0;
+        }
     }
 
-    if(i < st->numpeers) {
-        /* Already there, only need to refresh */
-        st->peers[i].time = now.tv_sec;
+    if(st->peers.numpeers + st->peers6.numpeers >= DHT_MAX_PEERS)
         return 0;
-    } else {
-        struct peer *p;
-        if(i >= st->maxpeers) {
-            /* Need to expand the array. */
-            struct peer *new_peers;
-            int n;
-            if(st->maxpeers >= DHT_MAX_PEERS)
-                return 0;
-            n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
-            n = MIN(n, DHT_MAX_PEERS);
-            new_peers = realloc(st->peers, n * sizeof(struct peer));
-            if(new_peers == NULL)
-                return -1;
-            st->peers = new_peers;
-            st->maxpeers = n;
-        }
-        p = &st->peers[st->numpeers++];
-        p->time = now.tv_sec;
-        p->len = len;
-        memcpy(p->ip, ip, len);
-        p->port = port;
-        return 1;
+
+    if(pl->numpeers >= pl->maxpeers) {
+        /* Need to expand the arrays, and the hash table with them. */
+        unsigned char *new_records;
+        dht_time_t *new_times;
+        int *new_index;
+        int n, size;
+        n = pl->maxpeers == 0 ? 2 : 2 * pl->maxpeers;
+        n = MIN(n, DHT_MAX_PEERS);
+        new_records = realloc(pl->records, n * len);
+        if(new_records == NULL)
+            return -1;
+        pl->records = new_records;
+        new_times = realloc(pl->times, n * sizeof(dht_time_t));
+        if(new_times == NULL)
+            return -1;
+        pl->times = new_times;
+        /* Keep the hash table at most half full. */
+        size = 4;
+        while(size < 2 * n)
+            size *= 2;
+        new_index = realloc(pl->index, size * sizeof(int));
+        if(new_index == NULL)
+            return -1;
+        pl->index = new_index;
+        pl->index_size = size;
+        pl->maxpeers = n;
+        rebuild_peer_index(pl, len);
+        slot = peer_slot(pl, record, len);
     }
-}
 
-static int
-expire_storage(void)
-{
-    struct storage *st = storage, *previous = NULL;
-    while(st) {
-        int i = 0;
-        while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
-                if(i != st->numpeers - 1)
-                    st->peers[i] = st->peers[st->numpeers - 1];
-                st->numpeers--;
-            } else {
-                i++;
-            }
-        }
+    memcpy(pl->records + pl->numpeers * len, record, len);
+    pl->times[pl->numpeers] = now;
+    pl->index[slot] = pl->numpeers++;
+    return 1;
+}
 
-        if(st->numpeers == 0) {
-            free(st->peers);
-            if(previous)
-                previous->next = st->next;
-            else
-                storage = st->next;
-            free(st);
-            if(previous)
-                st = previous->next;
-            else
-                st = storage;
-            numstorage--;
-            if(numstorage < 0) {
-                debugf("Eek... numstorage became negative.\n");
-                numstorage = 0;
+static void
+expire_peers(struct peer_list *pl, int len)
+{
+    int i = 0, changed = 0;
+
+    while(i < pl->numpeers) {
+        if(pl->times[i] < now - 32 * 60 * 1000) {
+            if(i != pl->numpeers - 1) {
+                memcpy(pl->records + i * len,
+                       pl->records + (pl->numpeers - 1) * len, len);
+                pl->times[i] = pl->times[pl->numpeers - 1];
             }
+            pl->numpeers--;
+            changed = 1;
         } else {
-            previous = st;
-            st = st->next;
+            i++;
         }
     }
+
+    if(changed)
+        rebuild_peer_index(pl, len);
+}
+
+/* Expires the peers of the i-th storage, and removes it if it is empty.
+   Returns 1 if it was removed. */
+static int
+expire_storage(int i)
+{
+    struct storage *st = &storage[i];
+
+    expire_peers(&st->peers, PEER_LEN);
+    expire_peers(&st->peers6, PEER6_LEN);
+    if(st->peers.numpeers == 0 && st->peers6.numpeers == 0) {
+        remove_storage(i);
+        return 1;
+    }
+    return 0;
+}
+
+/* Expiring everything in one go stalls dht_periodic for milliseconds when
+   storage is full.  Instead, we sweep the buckets, then the storage, then
+   the searches, doing about DHT_EXPIRE_BUDGET nodes or peers' worth of
+   work per call and resuming where we stopped on the next call.  Returns
+   1 when the sweep is complete. */
+static int
+expire_stuff(dht_callback_t *callback, void *closure)
+{
+    int work = 0;
+
+    if(!expire_in_progress) {
+        expire_bucket_cursor = buckets ? buckets : buckets6;
+        expire_storage_cursor = 0;
+        expire_in_progress = 1;
+    }
+
+    while(expire_bucket_cursor) {
+        struct bucket *b = expire_bucket_cursor;
+        if(work >= DHT_EXPIRE_BUDGET)
+            return 0;
+        work += expire_bucket(b) + 1;
+        if(b->next)
+            expire_bucket_cursor = b->next;
+        else if(b->af == AF_INET)
+            expire_bucket_cursor = buckets6;
+        else
+            expire_bucket_cursor = NULL;
+    }
+
+    while(expire_storage_cursor < numstorage) {
+        struct storage *st = &storage[expire_storage_cursor];
+        if(work >= DHT_EXPIRE_BUDGET)
+            return 0;
+        work += st->peers.numpeers + st->peers6.numpeers + 1;
+        /* If the storage was removed, another one took its place. */
+        if(!expire_storage(expire_storage_cursor))
+            expire_storage_cursor++;
+    }
+
+    expire_searches(callback, closure);
+    expire_in_progress = 0;
     return 1;
 }
 
@@ -1554,7 +3581,7 @@ rotate_secrets(void)
 {
     int rc;
 
-    rotate_secrets_time = now.tv_sec + 900 + random() % 1800;
+    rotate_secrets_time = now + (900 + random() % 1800) * 1000;
 
     memcpy(oldsecret, secret, sizeof(secret));
     rc = dht_random_bytes(secret, sizeof(secret));
@@ -1570,41 +3597,35 @@ rotate_secrets(void)
 #endif
 
 static void
-make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
+make_token(const struct address *a, int old, unsigned char *token_return)
 {
-    void *ip;
     int iplen;
     unsigned short port;
 
-    if(sa->sa_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
-        ip = &sin->sin_addr;
+    if(a->af == AF_INET)
         iplen = 4;
-        port = htons(sin->sin_port);
-    } else if(sa->sa_family == AF_INET6) {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
-        ip = &sin6->sin6_addr;
+    else if(a->af == AF_INET6)
         iplen = 16;
-        port = htons(sin6->sin6_port);
-    } else {
+    else
         abort();
-    }
+
+    port = ntohs(a->port);
 
     dht_hash(token_return, TOKEN_SIZE,
              old ? oldsecret : secret, sizeof(secret),
-             ip, iplen, (unsigned char*)&port, 2);
+             a->ip, iplen, (unsigned char*)&port, 2);
 }
 static int
 token_match(const unsigned char *token, int token_len,
-            const struct sockaddr *sa)
+            const struct address *a)
 {
     unsigned char t[TOKEN_SIZE];
     if(token_len != TOKEN_SIZE)
         return 0;
-    make_token(sa, 0, t);
+    make_token(a, 0, t);
     if(memcmp(t, token, TOKEN_SIZE) == 0)
         return 1;
-    make_token(sa, 1, t);
+    make_token(a, 1, t);
     if(memcmp(t, token, TOKEN_SIZE) == 0)
         return 1;
     return 0;
@@ -1618,8 +3639,9 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
     struct bucket *b = af == AF_INET ? buckets : buckets6;
 
     while(b) {
-        struct node *n = b->nodes;
-        while(n) {
+        int i;
+        for(i = 0; i < b->count; i++) {
+            struct node *n = &b->nodes[i];
             if(node_good(n)) {
                 good++;
                 if(n->time > n->reply_time)
@@ -1627,9 +3649,8 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
             } else {
                 dubious++;
             }
-            n = n->next;
         }
-        if(b->cached.ss_family > 0)
+        if(b->cached.af != 0)
             cached++;
         b = b->next;
     }
@@ -1644,50 +3665,107 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
     return good + dubious;
 }
 
+int
+dht_announce_stats(int *covered_return, int *failing_return,
+                   int *running_return)
+{
+    int i, covered = 0, failing = 0;
+
+    for(i = 0; i < announce_table_size; i++) {
+        struct announce *a;
+        for(a = announce_table[i]; a; a = a->hash_next) {
+            if(a->announced > 0 && a->announced >= now - announce_interval)
+                covered++;
+            if(a->failures > 0)
+                failing++;
+        }
+    }
+    if(covered_return)
+        *covered_return = covered;
+    if(failing_return)
+        *failing_return = failing;
+    if(running_return)
+        *running_return = announce_running;
+    return numannounces;
+}
+
+int
+dht_cache_stats(int *hits_return, int *misses_return, int *evictions_return)
+{
+    struct search *sr;
+    int fresh = 0;
+
+    for(sr = searches; sr; sr = sr->next) {
+        if(sr->cache_time > 0 && now - sr->cache_time < cache_ttl)
+            fresh++;
+    }
+    if(hits_return)
+        *hits_return = cache_hits;
+    if(misses_return)
+        *misses_return = cache_misses;
+    if(evictions_return)
+        *evictions_return = cache_evictions;
+    return fresh;
+}
+
+int
+dht_search_peers(const unsigned char *id, int af,
+                 int *peers_return, int *duplicates_return)
+{
+    struct search *sr = find_search_by_id(id, af);
+
+    if(sr == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if(peers_return)
+        *peers_return = sr->numpeers;
+    if(duplicates_return)
+        *duplicates_return = sr->duplicates;
+    return 1;
+}
+
 static void
 dump_bucket(FILE *f, struct bucket *b)
 {
-    struct node *n = b->nodes;
+    int i;
     fprintf(f, "Bucket ");
     print_hex(f, b->first, 20);
     fprintf(f, " count %d/%d age %d%s%s:\n",
-            b->count, b->max_count, (int)(now.tv_sec - b->time),
+            b->count, b->max_count, (int)((now - b->time) / 1000),
             in_bucket(myid, b) ? " (mine)" : "",
-            b->cached.ss_family ? " (cached)" : "");
-    while(n) {
+            b->cached.af ? " (cached)" : "");
+    for(i = 0; i < b->count; i++) {
+        struct node *n = &b->nodes[i];
         char buf[512];
         unsigned short port;
         fprintf(f, "    Node ");
-        print_hex(f, n->id, 20);
-        if(n->ss.ss_family == AF_INET) {
-            struct sockaddr_in *sin = (struct sockaddr_in*)&n->ss;
-            inet_ntop(AF_INET, &sin->sin_addr, buf, 512);
-            port = ntohs(sin->sin_port);
-        } else if(n->ss.ss_family == AF_INET6) {
-            struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&n->ss;
-            inet_ntop(AF_INET6, &sin6->sin6_addr, buf, 512);
-            port = ntohs(sin6->sin6_port);
+        print_hex(f, b->ids[i], 20);
+        if(n->addr.af == AF_INET || n->addr.af == AF_INET6) {
+            inet_ntop(n->addr.af, n->addr.ip, buf, 512);
+            port = ntohs(n->addr.port);
         } else {
-            snprintf(buf, 512, "unknown(%d)", n->ss.ss_family);
+            snprintf(buf, 512, "unknown(%d)", n->addr.af);
             port = 0;
         }
 
-        if(n->ss.ss_family == AF_INET6)
+        if(n->addr.af == AF_INET6)
             fprintf(f, " [%s]:%d ", buf, port);
         else
             fprintf(f, " %s:%d ", buf, port);
         if(n->time != n->reply_time)
             fprintf(f, "age %ld, %ld",
-                    (long)(now.tv_sec - n->time),
-                    (long)(now.tv_sec - n->reply_time));
+                    (long)((now - n->time) / 1000),
+                    (long)((now - n->reply_time) / 1000));
         else
-            fprintf(f, "age %ld", (long)(now.tv_sec - n->time));
+            fprintf(f, "age %ld", (long)((now - n->time) / 1000));
+        if(n->rtt.srtt)
+            fprintf(f, " rtt %d/%d", n->rtt.srtt, n->rtt.rttvar);
         if(n->pinged)
             fprintf(f, " (%d)", n->pinged);
         if(node_good(n))
             fprintf(f, " (good)");
         fprintf(f, "\n");
-        n = n->next;
     }
 
 }
@@ -1695,9 +3773,8 @@ dump_bucket(FILE *f, struct bucket *b)
 void
 dht_dump_tables(FILE *f)
 {
-    int i;
+    int i, j;
     struct bucket *b;
-    struct storage *st = storage;
     struct search *sr = searches;
 
     fprintf(f, "My id ");
@@ -1721,7 +3798,7 @@ dht_dump_tables(FILE *f)
     while(sr) {
         fprintf(f, "\nSearch%s id ", sr->af == AF_INET6 ? " (IPv6)" : "");
         print_hex(f, sr->id, 20);
-        fprintf(f, " age %d%s\n", (int)(now.tv_sec - sr->step_time),
+        fprintf(f, " age %d%s\n", (int)((now - sr->step_time) / 1000),
                sr->done ? " (done)" : "");
         for(i = 0; i < sr->numnodes; i++) {
             struct search_node *n = &sr->nodes[i];
@@ -1729,43 +3806,73 @@ dht_dump_tables(FILE *f)
             print_hex(f, n->id, 20);
             fprintf(f, " bits %d age ", common_bits(sr->id, n->id));
             if(n->request_time)
-                fprintf(f, "%d, ", (int)(now.tv_sec - n->request_time));
-            fprintf(f, "%d", (int)(now.tv_sec - n->reply_time));
+                fprintf(f, "%d, ", (int)((now - n->request_time) / 1000));
+            fprintf(f, "%d", (int)((now - n->reply_time) / 1000));
             if(n->pinged)
                 fprintf(f, " (%d)", n->pinged);
             fprintf(f, "%s%s.\n",
-                    find_node(n->id, sr->af) ? " (known)" : "",
+                    find_node(n->id, sr->af, NULL) ? " (known)" : "",
                     n->replied ? " (replied)" : "");
         }
         sr = sr->next;
     }
 
-    while(st) {
+    for(j = 0; j < numstorage; j++) {
+        struct storage *st = &storage[j];
         fprintf(f, "\nStorage ");
         print_hex(f, st->id, 20);
-        fprintf(f, " %d/%d nodes:", st->numpeers, st->maxpeers);
-        for(i = 0; i < st->numpeers; i++) {
+        fprintf(f, " %d+%d/%d+%d nodes:",
+                st->peers.numpeers, st->peers6.numpeers,
+                st->peers.maxpeers, st->peers6.maxpeers);
+        for(i = 0; i < st->peers.numpeers; i++) {
+            const unsigned char *r = st->peers.records + i * PEER_LEN;
             char buf[100];
-            if(st->peers[i].len == 4) {
-                inet_ntop(AF_INET, st->peers[i].ip, buf, 100);
-            } else if(st->peers[i].len == 16) {
-                buf[0] = '[';
-                inet_ntop(AF_INET6, st->peers[i].ip, buf + 1, 98);
-                strcat(buf, "]");
-            } else {
-                strcpy(buf, "???");
-            }
-            fprintf(f, " %s:%u (%ld)",
-                    buf, st->peers[i].port,
-                    (long)(now.tv_sec - st->peers[i].time));
+            unsigned short port;
+            inet_ntop(AF_INET, r + 2, buf, 100);
+            memcpy(&port, r + 6, 2);
+            fprintf(f, " %s:%u (%ld)", buf, ntohs(port),
+                    (long)((now - st->peers.times[i]) / 1000));
+        }
+        for(i = 0; i < st->peers6.numpeers; i++) {
+            const unsigned char *r = st->peers6.records + i * PEER6_LEN;
+            char buf[100];
+            unsigned short port;
+            buf[0] = '[';
+            inet_ntop(AF_INET6, r + 3, buf + 1, 98);
+            strcat(buf, "]");
+            memcpy(&port, r + 19, 2);
+            fprintf(f, " %s:%u (%ld)", buf, ntohs(port),
+                    (long)((now - st->peers6.times[i]) / 1000));
         }
-        st = st->next;
     }
 
     fprintf(f, "\n\n");
     fflush(f);
 }
 
+static void
+make_templates(const unsigned char *v)
+{
+    int i = 0;
+
+    memcpy(query_header, "d1:ad2:id20:", 12);
+    memcpy(query_header + 12, myid, 20);
+    memcpy(reply_header, "d1:rd2:id20:", 12);
+    memcpy(reply_header + 12, myid, 20);
+
+    if(v) {
+        memcpy(query_trailer, "1:v4:", 5);
+        memcpy(query_trailer + 5, v, 4);
+        i = 9;
+    }
+    memcpy(reply_trailer, query_trailer, i);
+    memcpy(error_trailer, query_trailer, i);
+    memcpy(query_trailer + i, "1:y1:qe", 7);
+    memcpy(reply_trailer + i, "1:y1:re", 7);
+    memcpy(error_trailer + i, "1:y1:ee", 7);
+    trailer_len = i + 7;
+}
+
 int
 dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 {
@@ -1778,73 +3885,93 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
 
     searches = NULL;
     numsearches = 0;
+    memset(search_by_tid, 0, sizeof(search_by_tid));
+    memset(search_by_id, 0, sizeof(search_by_id));
+    done_searches = done_searches_last = NULL;
+    search_heap_size = 0;
+    hungry_searches = NULL;
+    cache_hits = cache_misses = cache_evictions = 0;
 
     storage = NULL;
-    numstorage = 0;
+    numstorage = maxstorage = 0;
+    storage_index = NULL;
+    storage_index_size = 0;
 
     if(s >= 0) {
         buckets = calloc(1, sizeof(struct bucket));
         if(buckets == NULL)
             return -1;
-        buckets->max_count = 128;
+        if(bucket_alloc(buckets, 128) < 0)
+            goto fail;
         buckets->af = AF_INET;
+        bucket_index[0] = buckets;
+        mybucket_depth = 0;
     }
 
     if(s6 >= 0) {
         buckets6 = calloc(1, sizeof(struct bucket));
         if(buckets6 == NULL)
             return -1;
-        buckets6->max_count = 128;
+        if(bucket_alloc(buckets6, 128) < 0)
+            goto fail;
         buckets6->af = AF_INET6;
+        bucket_index6[0] = buckets6;
+        mybucket6_depth = 0;
     }
 
     memcpy(myid, id, 20);
-    if(v) {
-        memcpy(my_v, "1:v4:", 5);
-        memcpy(my_v + 5, v, 4);
-        have_v = 1;
-    } else {
-        have_v = 0;
-    }
+    make_templates(v);
 
-    dht_gettimeofday(&now, NULL);
+    now = dht_now();
 
-    mybucket_grow_time = now.tv_sec;
-    mybucket6_grow_time = now.tv_sec;
-    confirm_nodes_time = now.tv_sec + random() % 3;
+    mybucket_grow_time = now;
+    mybucket6_grow_time = now;
+    confirm_nodes_time = now + random() % 3000;
 
     search_id = random() & 0xFFFF;
-    search_time = 0;
 
-    next_blacklisted = 0;
+    memset(blacklist, 0, sizeof(blacklist));
+    numblacklisted = 0;
 
-    token_bucket_time = now.tv_sec;
+    token_bucket_time = now;
     token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
+    memset(source_buckets, 0, sizeof(source_buckets));
+    memset(&global_rtt, 0, sizeof(global_rtt));
 
     memset(secret, 0, sizeof(secret));
     rc = rotate_secrets();
     if(rc < 0)
         goto fail;
 
+    rc = dht_random_bytes(&peer_hash_key, sizeof(peer_hash_key));
+    if(rc < 0)
+        goto fail;
+
     dht_socket = s;
     dht_socket6 = s6;
 
-    expire_buckets(buckets);
-    expire_buckets(buckets6);
+    expire_stuff_time = now + (120 + random() % 240) * 1000;
+    expire_in_progress = 0;
 
     return 1;
 
  fail:
-    free(buckets);
+    if(buckets)
+        bucket_free(buckets);
     buckets = NULL;
-    free(buckets6);
+    if(buckets6)
+        bucket_free(buckets6);
     buckets6 = NULL;
+    memset(bucket_index, 0, sizeof(bucket_index));
+    memset(bucket_index6, 0, sizeof(bucket_index6));
     return -1;
 }
 
 int
 dht_uninit(void)
 {
+    int i;
+
     if(dht_socket < 0 && dht_socket6 < 0) {
         errno = EINVAL;
         return -1;
@@ -1856,52 +3983,176 @@ dht_uninit(void)
     while(buckets) {
         struct bucket *b = buckets;
         buckets = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
-        }
-        free(b);
+        bucket_free(b);
     }
 
     while(buckets6) {
         struct bucket *b = buckets6;
         buckets6 = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
-        }
-        free(b);
+        bucket_free(b);
     }
 
-    while(storage) {
-        struct storage *st = storage;
-        storage = storage->next;
-        free(st->peers);
-        free(st);
+    memset(bucket_index, 0, sizeof(bucket_index));
+    memset(bucket_index6, 0, sizeof(bucket_index6));
+    expire_in_progress = 0;
+    expire_bucket_cursor = NULL;
+
+    for(i = 0; i < numstorage; i++) {
+        free_peers(&storage[i].peers);
+        free_peers(&storage[i].peers6);
     }
+    free(storage);
+    free(storage_index);
+    storage = NULL;
+    numstorage = maxstorage = 0;
+    storage_index = NULL;
+    storage_index_size = 0;
 
     while(searches) {
         struct search *sr = searches;
         searches = searches->next;
-        free(sr);
+        free_search(sr);
     }
+    numsearches = 0;
+    memset(search_by_tid, 0, sizeof(search_by_tid));
+    memset(search_by_id, 0, sizeof(search_by_id));
+    done_searches = done_searches_last = NULL;
+    search_heap_size = 0;
+    hungry_searches = NULL;
+
+    free(pending_searches);
+    pending_searches = NULL;
+    pending_first = numpending = maxpending = 0;
+    pending_time = 0;
+
+    for(i = 0; i < announce_table_size; i++) {
+        while(announce_table[i]) {
+            struct announce *a = announce_table[i];
+            announce_table[i] = a->hash_next;
+            free(a);
+        }
+    }
+    free(announce_table);
+    announce_table = NULL;
+    announce_table_size = numannounces = announce_running = 0;
+    memset(announce_wheel, 0, sizeof(announce_wheel));
+
+    return 1;
+}
+
+int
+dht_set_parameter(int parameter, int value)
+{
+    /* Only the cache may be disabled. */
+    if(value < 0 || (value == 0 && parameter != DHT_PARAM_CACHE_TTL &&
+                     parameter != DHT_PARAM_CACHE_REFRESH))
+        goto fail;
 
+    switch(parameter) {
+    case DHT_PARAM_SEARCH_WINDOW:
+        if(value > SEARCH_NODES)
+            goto fail;
+        search_window = value;
+        break;
+    case DHT_PARAM_SEARCH_WINDOW_MIN:
+        if(value > search_window_max)
+            goto fail;
+        search_window_min = value;
+        break;
+    case DHT_PARAM_SEARCH_WINDOW_MAX:
+        if(value > SEARCH_NODES || value < search_window_min)
+            goto fail;
+        search_window_max = value;
+        break;
+    case DHT_PARAM_SEARCH_STABLE_REPLIES:
+        search_stable_replies = value;
+        break;
+    case DHT_PARAM_SEARCH_MAX_QUERIES:
+        search_max_queries = value;
+        break;
+    case DHT_PARAM_SEARCH_MAX_TIME:
+        search_max_time = value;
+        break;
+    case DHT_PARAM_SEARCH_RATE:
+        if(value > 1000)
+            goto fail;
+        search_rate = value;
+        break;
+    case DHT_PARAM_SEARCH_CONCURRENCY:
+        search_concurrency = value;
+        break;
+    case DHT_PARAM_CACHE_TTL:
+        /* Done searches don't live any longer. */
+        if(value > DHT_SEARCH_EXPIRE_TIME)
+            goto fail;
+        cache_ttl = value;
+        break;
+    case DHT_PARAM_CACHE_REFRESH:
+        cache_refresh = value;
+        break;
+    case DHT_PARAM_ANNOUNCE_INTERVAL:
+        /* The wheel must not wrap around within an interval. */
+        if(value > (ANNOUNCE_WHEEL_SIZE - 1) * ANNOUNCE_SLOT)
+            goto fail;
+        announce_interval = value;
+        break;
+    case DHT_PARAM_ANNOUNCE_CONCURRENCY:
+        announce_concurrency = value;
+        break;
+    default:
+        goto fail;
+    }
     return 1;
+
+ fail:
+    errno = EINVAL;
+    return -1;
 }
 
 /* Rate control for requests we receive. */
 
+/* Refill an empty bucket with one token every interval ms since *time,
+   up to max; keep the remainder for next time. */
+static void
+refill_bucket(dht_time_t *time, int *tokens, int max, int interval)
+{
+    dht_time_t n = (now - *time) / interval;
+    if(n >= max) {
+        *tokens = max;
+        *time = now;
+    } else {
+        *tokens = n;
+        *time += n * interval;
+    }
+}
+
 static int
-token_bucket(void)
+token_bucket(const struct address *source)
 {
-    if(token_bucket_tokens == 0) {
-        token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
-                                  100 * (now.tv_sec - token_bucket_time));
-        token_bucket_time = now.tv_sec;
+    /* An IPv6 /64 is usually a single host. */
+    unsigned h = peer_hash(source->ip, source->af == AF_INET ? 4 : 8);
+    int i, ok = 0;
+
+    for(i = 0; i < SOURCE_BUCKET_ROWS; i++) {
+        struct source_bucket *sb =
+            &source_buckets[i][(h >> (10 * i)) % SOURCE_BUCKETS];
+        if(sb->tokens == 0)
+            refill_bucket(&sb->time, &sb->tokens,
+                          MAX_SOURCE_BUCKET_TOKENS, SOURCE_TOKEN_INTERVAL);
+        if(sb->tokens > 0) {
+            sb->tokens--;
+            ok = 1;
+        }
     }
 
+    if(!ok)
+        return 0;
+
+    /* One token every 10ms for everyone. */
+    if(token_bucket_tokens == 0)
+        refill_bucket(&token_bucket_time, &token_bucket_tokens,
+                      MAX_TOKEN_BUCKET_TOKENS, 10);
+
     if(token_bucket_tokens == 0)
         return 0;
 
@@ -1942,9 +4193,8 @@ neighbourhood_maintenance(int af)
             debugf("Sending find_node for%s neighborhood maintenance.\n",
                    af == AF_INET6 ? " IPv6" : "");
             make_tid(tid, "fn", 0);
-            send_find_node((struct sockaddr*)&n->ss, n->sslen,
-                           tid, 4, id, want,
-                           n->reply_time >= now.tv_sec - 15);
+            send_find_node(&n->addr, tid, 4, id, want,
+                           n->reply_time >= now - 15 * 1000);
             pinged(n, q);
         }
         return 1;
@@ -1961,9 +4211,9 @@ bucket_maintenance(int af)
 
     while(b) {
         /* 10 minutes for an 8-node bucket */
-        int to = MAX(600 / (b->max_count / 8), 30);
+        int to = MAX(600 / (b->max_count / 8), 30) * 1000;
         struct bucket *q;
-        if(b->time < now.tv_sec - to) {
+        if(b->time < now - to) {
             /* This bucket hasn't seen any positive confirmation for a long
                time.  Pick a random id in this bucket's range, and send
                a request to a random node. */
@@ -2014,9 +4264,8 @@ bucket_maintenance(int af)
                     debugf("Sending find_node for%s bucket maintenance.\n",
                            af == AF_INET6 ? " IPv6" : "");
                     make_tid(tid, "fn", 0);
-                    send_find_node((struct sockaddr*)&n->ss, n->sslen,
-                                   tid, 4, id, want,
-                                   n->reply_time >= now.tv_sec - 15);
+                    send_find_node(&n->addr, tid, 4, id, want,
+                                   n->reply_time >= now - 15 * 1000);
                     pinged(n, q);
                     /* In order to avoid sending queries back-to-back,
                        give up for now and reschedule us soon. */
@@ -2032,20 +4281,26 @@ bucket_maintenance(int af)
 int
 dht_periodic(const void *buf, size_t buflen,
              const struct sockaddr *from, int fromlen,
-             time_t *tosleep,
+             struct timeval *tosleep,
              dht_callback_t *callback, void *closure)
 {
-    dht_gettimeofday(&now, NULL);
+    dht_time_t sleep_time;
+
+    now = dht_now();
 
     if(buflen > 0) {
         int message;
         struct parsed_message m;
+        struct address source;
         unsigned short ttid;
 
-        if(is_martian(from))
+        if(sockaddr_to_address(from, fromlen, &source) < 0)
             goto dontread;
 
-        if(node_blacklisted(from, fromlen)) {
+        if(is_martian(&source))
+            goto dontread;
+
+        if(node_blacklisted(&source)) {
             debugf("Received packet from blacklisted node.\n");
             goto dontread;
         }
@@ -2059,7 +4314,31 @@ dht_periodic(const void *buf, size_t buflen,
         memset(&m, 0, sizeof(m));
         message = parse_message(buf, buflen, &m);
 
-        if(message < 0 || message == ERROR || id_cmp(m.id, zeroes) == 0) {
+        /* An announce with the tokens of an earlier lookup was refused,
+           presumably because they have expired.  Errors carry no id, so
+           check that it comes from one of the nodes we announced to. */
+        if(message == ERROR && m.tid_len == 4 &&
+           tid_match(m.tid, "ap", &ttid)) {
+            struct search *sr = find_search(ttid, source.af);
+            if(sr && sr->reannounce && !sr->done) {
+                int i;
+                for(i = 0; i < sr->numnodes; i++)
+                    if(address_equal(&sr->nodes[i].addr, &source))
+                        break;
+                if(i < sr->numnodes) {
+                    debugf("Announce refused, looking up.\n");
+                    reset_lookup(sr);
+                    search_step(sr, callback, closure);
+                    if(!sr->done)
+                        schedule_search(sr);
+                }
+            }
+            goto dontread;
+        }
+
+        if(message < 0 || message == ERROR ||
+           m.id == NULL || id_cmp(m.id, zeroes) == 0 ||
+           (message > REPLY && m.tid == NULL)) {
             debugf("Unparseable message: ");
             debug_printable(buf, buflen);
             debugf("\n");
@@ -2073,7 +4352,7 @@ dht_periodic(const void *buf, size_t buflen,
 
         if(message > REPLY) {
             /* Rate limit requests. */
-            if(!token_bucket()) {
+            if(!token_bucket(&source)) {
                 debugf("Dropping request due to rate limiting.\n");
                 goto dontread;
             }
@@ -2088,109 +4367,134 @@ dht_periodic(const void *buf, size_t buflen,
                 /* This is really annoying, as it means that we will
                    time-out all our searches that go through this node.
                    Kill it. */
-                blacklist_node(m.id, from, fromlen);
+                blacklist_node(m.id, &source);
                 goto dontread;
             }
             if(tid_match(m.tid, "pn", NULL)) {
                 debugf("Pong!\n");
-                new_node(m.id, from, fromlen, 2);
+                new_node(m.id, &source, 2);
             } else if(tid_match(m.tid, "fn", NULL) ||
                       tid_match(m.tid, "gp", NULL)) {
-                int gp = 0;
+                int gp = 0, progress = 0;
                 struct search *sr = NULL;
                 if(tid_match(m.tid, "gp", &ttid)) {
                     gp = 1;
-                    sr = find_search(ttid, from->sa_family);
+                    sr = find_search(ttid, source.af);
                 }
                 debugf("Nodes found (%d+%d)%s!\n",
                        m.nodes_len/26, m.nodes6_len/38,
                        gp ? " for get_peers" : "");
                 if(m.nodes_len % 26 != 0 || m.nodes6_len % 38 != 0) {
                     debugf("Unexpected length for node info!\n");
-                    blacklist_node(m.id, from, fromlen);
+                    blacklist_node(m.id, &source);
                 } else if(gp && sr == NULL) {
                     debugf("Unknown search!\n");
-                    new_node(m.id, from, fromlen, 1);
+                    new_node(m.id, &source, 1);
                 } else {
                     int i;
-                    new_node(m.id, from, fromlen, 2);
+                    unsigned char closest[20];
+                    int numnodes = sr ? sr->numnodes : 0;
+                    if(numnodes > 0)
+                        memcpy(closest, sr->nodes[0].id, 20);
+                    /* Inserting a new node among the 8 closest resets
+                       this to 0, see insert_search_node. */
+                    if(sr)
+                        sr->stable++;
+                    new_node(m.id, &source, 2);
                     for(i = 0; i < m.nodes_len / 26; i++) {
-                        unsigned char *ni = m.nodes + i * 26;
-                        struct sockaddr_in sin;
+                        const unsigned char *ni = m.nodes + i * 26;
+                        struct address a;
                         if(id_cmp(ni, myid) == 0)
                             continue;
-                        memset(&sin, 0, sizeof(sin));
-                        sin.sin_family = AF_INET;
-                        memcpy(&sin.sin_addr, ni + 20, 4);
-                        memcpy(&sin.sin_port, ni + 24, 2);
-                        new_node(ni, (struct sockaddr*)&sin, sizeof(sin), 0);
-                        if(sr && sr->af == AF_INET) {
-                            insert_search_node(ni,
-                                               (struct sockaddr*)&sin,
-                                               sizeof(sin),
-                                               sr, 0, NULL, 0);
-                        }
+                        compact_to_address(ni + 20, AF_INET, &a);
+                        new_node(ni, &a, 0);
+                        if(sr && sr->af == AF_INET)
+                            insert_search_node(ni, &a, sr, 0, NULL, 0);
                     }
                     for(i = 0; i < m.nodes6_len / 38; i++) {
-                        unsigned char *ni = m.nodes6 + i * 38;
-                        struct sockaddr_in6 sin6;
+                        const unsigned char *ni = m.nodes6 + i * 38;
+                        struct address a;
                         if(id_cmp(ni, myid) == 0)
                             continue;
-                        memset(&sin6, 0, sizeof(sin6));
-                        sin6.sin6_family = AF_INET6;
-                        memcpy(&sin6.sin6_addr, ni + 20, 16);
-                        memcpy(&sin6.sin6_port, ni + 36, 2);
-                        new_node(ni, (struct sockaddr*)&sin6, sizeof(sin6), 0);
-                        if(sr && sr->af == AF_INET6) {
-                            insert_search_node(ni,
-                                               (struct sockaddr*)&sin6,
-                                               sizeof(sin6),
-                                               sr, 0, NULL, 0);
-                        }
+                        compact_to_address(ni + 20, AF_INET6, &a);
+                        new_node(ni, &a, 0);
+                        if(sr && sr->af == AF_INET6)
+                            insert_search_node(ni, &a, sr, 0, NULL, 0);
                     }
-                    if(sr)
-                        /* Since we received a reply, the number of
-                           requests in flight has decreased.  Let's push
-                           another request. */
-                        search_send_get_peers(sr, NULL);
+                    /* Did this reply bring us closer to the target? */
+                    if(sr && sr->numnodes > 0 &&
+                       (numnodes == 0 ||
+                        id_cmp(closest, sr->nodes[0].id) != 0))
+                        progress = 1;
                 }
                 if(sr) {
-                    insert_search_node(m.id, from, fromlen, sr,
+                    insert_search_node(m.id, &source, sr,
                                        1, m.token, m.token_len);
-                    if(m.values_len > 0 || m.values6_len > 0) {
+                    if(!sr->done && progress)
+                        sr->window = MIN(sr->window + 1, search_window_max);
+                    if(m.numvalues > 0 || m.numvalues6 > 0) {
                         debugf("Got values (%d+%d)!\n",
-                               m.values_len / 6, m.values6_len / 18);
-                        if(callback) {
-                            if(m.values_len > 0)
-                                (*callback)(closure, DHT_EVENT_VALUES, sr->id,
-                                            (void*)m.values, m.values_len);
-
-                            if(m.values6_len > 0)
-                                (*callback)(closure, DHT_EVENT_VALUES6, sr->id,
-                                            (void*)m.values6, m.values6_len);
+                               m.numvalues, m.numvalues6);
+                        if(callback || sr->callback || sr->numwaiters > 0 ||
+                           cache_ttl > 0) {
+                            unsigned char values[PARSE_VALUES_LEN];
+                            unsigned char values6[PARSE_VALUES6_LEN];
+                            int len;
+
+                            len = extract_values(&m, 6,
+                                                 values, PARSE_VALUES_LEN);
+                            len = search_filter_values(sr, values, len, 6);
+                            if(sr->af == AF_INET)
+                                cache_found(sr, values, len);
+                            if(len > 0)
+                                search_event(sr, DHT_EVENT_VALUES,
+                                             values, len, callback, closure);
+
+                            len = extract_values(&m, 18,
+                                                 values6, PARSE_VALUES6_LEN);
+                            len = search_filter_values(sr, values6, len, 18);
+                            if(sr->af == AF_INET6)
+                                cache_found(sr, values6, len);
+                            if(len > 0)
+                                search_event(sr, DHT_EVENT_VALUES6,
+                                             values6, len, callback, closure);
                         }
                     }
+                    if(!sr->done) {
+                        /* Since we received a reply, the number of
+                           requests in flight has decreased, and the
+                           lookup may have converged.  Step the search
+                           now rather than waiting for a timeout. */
+                        search_step(sr, callback, closure);
+                        if(!sr->done)
+                            schedule_search(sr);
+                    }
                 }
             } else if(tid_match(m.tid, "ap", &ttid)) {
                 struct search *sr;
                 debugf("Got reply to announce_peer.\n");
-                sr = find_search(ttid, from->sa_family);
+                sr = find_search(ttid, source.af);
                 if(!sr) {
                     debugf("Unknown search!\n");
-                    new_node(m.id, from, fromlen, 1);
+                    new_node(m.id, &source, 1);
                 } else {
                     int i;
-                    new_node(m.id, from, fromlen, 2);
+                    new_node(m.id, &source, 2);
                     for(i = 0; i < sr->numnodes; i++)
                         if(id_cmp(sr->nodes[i].id, m.id) == 0) {
+                            if(sr->nodes[i].pinged == 1 &&
+                               sr->nodes[i].request_time > 0)
+                                rtt_sample(&sr->nodes[i].rtt,
+                                           now - sr->nodes[i].request_time);
                             sr->nodes[i].request_time = 0;
-                            sr->nodes[i].reply_time = now.tv_sec;
+                            sr->nodes[i].reply_time = now;
                             sr->nodes[i].acked = 1;
                             sr->nodes[i].pinged = 0;
                             break;
                         }
                     /* See comment for gp above. */
-                    search_send_get_peers(sr, NULL);
+                    if(!sr->done)
+                        search_fill_window(sr);
                 }
             } else {
                 debugf("Unexpected reply: ");
@@ -2200,41 +4504,51 @@ dht_periodic(const void *buf, size_t buflen,
             break;
         case PING:
             debugf("Ping (%d)!\n", m.tid_len);
-            new_node(m.id, from, fromlen, 1);
+            new_node(m.id, &source, 1);
             debugf("Sending pong.\n");
-            send_pong(from, fromlen, m.tid, m.tid_len);
+            send_pong(&source, m.tid, m.tid_len);
             break;
         case FIND_NODE:
             debugf("Find node!\n");
-            new_node(m.id, from, fromlen, 1);
+            new_node(m.id, &source, 1);
+            if(m.target == NULL) {
+                debugf("Eek!  Got find_node with no target.\n");
+                send_error(&source, m.tid, m.tid_len,
+                           203, "Find_node with no target");
+                break;
+            }
             debugf("Sending closest nodes (%d).\n", m.want);
-            send_closest_nodes(from, fromlen,
+            send_closest_nodes(&source,
                                m.tid, m.tid_len, m.target, m.want,
                                0, NULL, NULL, 0);
             break;
         case GET_PEERS:
             debugf("Get_peers!\n");
-            new_node(m.id, from, fromlen, 1);
-            if(id_cmp(m.info_hash, zeroes) == 0) {
+            new_node(m.id, &source, 1);
+            if(m.info_hash == NULL || id_cmp(m.info_hash, zeroes) == 0) {
                 debugf("Eek!  Got get_peers with no info_hash.\n");
-                send_error(from, fromlen, m.tid, m.tid_len,
+                send_error(&source, m.tid, m.tid_len,
                            203, "Get_peers with no info_hash");
                 break;
             } else {
                 struct storage *st = find_storage(m.info_hash);
                 unsigned char token[TOKEN_SIZE];
-                make_token(from, 0, token);
-                if(st && st->numpeers > 0) {
+                int found = 0;
+                make_token(&source, 0, token);
+                if(st)
+                    found = source.af == AF_INET ?
+                        st->peers.numpeers : st->peers6.numpeers;
+                if(found > 0) {
                      debugf("Sending found%s peers.\n",
-                            from->sa_family == AF_INET6 ? " IPv6" : "");
-                     send_closest_nodes(from, fromlen,
+                            source.af == AF_INET6 ? " IPv6" : "");
+                     send_closest_nodes(&source,
                                         m.tid, m.tid_len,
                                         m.info_hash, m.want,
-                                        from->sa_family, st,
+                                        source.af, st,
                                         token, TOKEN_SIZE);
                 } else {
                     debugf("Sending nodes for get_peers.\n");
-                    send_closest_nodes(from, fromlen,
+                    send_closest_nodes(&source,
                                        m.tid, m.tid_len, m.info_hash, m.want,
                                        0, NULL, token, TOKEN_SIZE);
                 }
@@ -2242,91 +4556,74 @@ dht_periodic(const void *buf, size_t buflen,
             break;
         case ANNOUNCE_PEER:
             debugf("Announce peer!\n");
-            new_node(m.id, from, fromlen, 1);
-            if(id_cmp(m.info_hash, zeroes) == 0) {
+            new_node(m.id, &source, 1);
+            if(m.info_hash == NULL || id_cmp(m.info_hash, zeroes) == 0) {
                 debugf("Announce_peer with no info_hash.\n");
-                send_error(from, fromlen, m.tid, m.tid_len,
+                send_error(&source, m.tid, m.tid_len,
                            203, "Announce_peer with no info_hash");
                 break;
             }
-            if(!token_match(m.token, m.token_len, from)) {
+            if(!token_match(m.token, m.token_len, &source)) {
                 debugf("Incorrect token for announce_peer.\n");
-                send_error(from, fromlen, m.tid, m.tid_len,
+                send_error(&source, m.tid, m.tid_len,
                            203, "Announce_peer with wrong token");
                 break;
             }
             if(m.implied_port != 0) {
                 /* Do this even if port > 0.  That's what the spec says. */
-                switch(from->sa_family) {
-                case AF_INET:
-                    m.port = htons(((struct sockaddr_in*)from)->sin_port);
-                    break;
-                case AF_INET6:
-                    m.port = htons(((struct sockaddr_in6*)from)->sin6_port);
-                    break;
-                }
+                m.port = ntohs(source.port);
             }
             if(m.port == 0) {
                 debugf("Announce_peer with forbidden port %d.\n", m.port);
-                send_error(from, fromlen, m.tid, m.tid_len,
+                send_error(&source, m.tid, m.tid_len,
                            203, "Announce_peer with forbidden port number");
                 break;
             }
-            storage_store(m.info_hash, from, m.port);
+            storage_store(m.info_hash, &source, m.port);
             /* Note that if storage_store failed, we lie to the requestor.
                This is to prevent them from backtracking, and hence
                polluting the DHT. */
             debugf("Sending peer announced.\n");
-            send_peer_announced(from, fromlen, m.tid, m.tid_len);
+            send_peer_announced(&source, m.tid, m.tid_len);
         }
     }
 
  dontread:
-    if(now.tv_sec >= rotate_secrets_time)
+    if(now >= rotate_secrets_time)
         rotate_secrets();
 
-    if(now.tv_sec >= expire_stuff_time) {
-        expire_buckets(buckets);
-        expire_buckets(buckets6);
-        expire_storage();
-        expire_searches(callback, closure);
+    if(now >= expire_stuff_time) {
+        if(expire_stuff(callback, closure))
+            expire_stuff_time = now + (120 + random() % 240) * 1000;
+        else
+            expire_stuff_time = now + DHT_EXPIRE_PAUSE;
     }
 
-    if(search_time > 0 && now.tv_sec >= search_time) {
-        struct search *sr;
-        sr = searches;
-        while(sr) {
-            if(!sr->done &&
-               sr->step_time + DHT_SEARCH_RETRANSMIT / 2 + 1 <= now.tv_sec) {
-                search_step(sr, callback, closure);
-            }
-            sr = sr->next;
-        }
+    while(search_heap_size > 0 && search_heap[0]->next_step <= now) {
+        struct search *sr = search_heap[0];
+        unschedule_search(sr);
+        search_step(sr, callback, closure);
+        /* The callback may have restarted a search that just completed. */
+        if(!sr->done)
+            schedule_search(sr);
+    }
 
-        search_time = 0;
+    if(numpending > 0)
+        start_pending_searches(callback, closure);
 
-        sr = searches;
-        while(sr) {
-            if(!sr->done) {
-                time_t tm = sr->step_time +
-                    DHT_SEARCH_RETRANSMIT + random() % DHT_SEARCH_RETRANSMIT;
-                if(search_time == 0 || search_time > tm)
-                    search_time = tm;
-            }
-            sr = sr->next;
-        }
-    }
+    if(numannounces > 0)
+        run_announces(callback, closure);
 
-    if(now.tv_sec >= confirm_nodes_time) {
+    if(now >= confirm_nodes_time) {
         int soon = 0;
 
         soon |= bucket_maintenance(AF_INET);
         soon |= bucket_maintenance(AF_INET6);
 
         if(!soon) {
-            if(mybucket_grow_time >= now.tv_sec - 150)
+            if(mybucket_grow_time >= now - 150 * 1000)
                 soon |= neighbourhood_maintenance(AF_INET);
-            if(mybucket6_grow_time >= now.tv_sec - 150)
+            if(mybucket6_grow_time >= now - 150 * 1000)
                 soon |= neighbourhood_maintenance(AF_INET6);
         }
 
@@ -2337,22 +4634,35 @@ dht_periodic(const void *buf, size_t buflen,
            maintenance. */
 
         if(soon)
-            confirm_nodes_time = now.tv_sec + 5 + random() % 10;
+            confirm_nodes_time = now + 5000 + random() % 10000;
         else
-            confirm_nodes_time = now.tv_sec + 60 + random() % 120;
+            confirm_nodes_time = now + (60 + random() % 120) * 1000;
     }
 
-    if(confirm_nodes_time > now.tv_sec)
-        *tosleep = confirm_nodes_time - now.tv_sec;
+    if(confirm_nodes_time > now)
+        sleep_time = confirm_nodes_time - now;
     else
-        *tosleep = 0;
+        sleep_time = 0;
 
-    if(search_time > 0) {
-        if(search_time <= now.tv_sec)
-            *tosleep = 0;
-        else if(*tosleep > search_time - now.tv_sec)
-            *tosleep = search_time - now.tv_sec;
-    }
+    if(search_heap_size > 0 &&
+       sleep_time > search_heap[0]->next_step - now)
+        sleep_time = MAX(search_heap[0]->next_step - now, 0);
+
+    if(numpending > 0 && search_heap_size < search_concurrency &&
+       sleep_time > pending_time - now)
+        sleep_time = MAX(pending_time - now, 0);
+
+    /* Come back when the next slot of the wheel holding announces ends;
+       an idle node need not wake up for each of the empty ones. */
+    if(numannounces > 0 && announce_running < announce_concurrency)
+        sleep_time = MAX(announce_wakeup(now + sleep_time) - now, 0);
+
+    /* Come back soon to finish an expiry sweep. */
+    if(expire_in_progress && sleep_time > expire_stuff_time - now)
+        sleep_time = MAX(expire_stuff_time - now, 0);
+
+    tosleep->tv_sec = sleep_time / 1000;
+    tosleep->tv_usec = sleep_time % 1000 * 1000;
 
     return 1;
 }
@@ -2361,7 +4671,7 @@ int
 dht_get_nodes(struct sockaddr_in *sin, int *num,
               struct sockaddr_in6 *sin6, int *num6)
 {
-    int i, j;
+    int i, j, k;
     struct bucket *b;
     struct node *n;
 
@@ -2373,25 +4683,25 @@ dht_get_nodes(struct sockaddr_in *sin, int *num,
     if(b == NULL)
         goto no_ipv4;
 
-    n = b->nodes;
-    while(n && i < *num) {
+    for(k = 0; k < b->count && i < *num; k++) {
+        n = &b->nodes[k];
         if(node_good(n)) {
-            sin[i] = *(struct sockaddr_in*)&n->ss;
+            address_to_sockaddr(&n->addr, (struct sockaddr*)&sin[i],
+                                sizeof(struct sockaddr_in));
             i++;
         }
-        n = n->next;
     }
 
     b = buckets;
     while(b && i < *num) {
         if(!in_bucket(myid, b)) {
-            n = b->nodes;
-            while(n && i < *num) {
+            for(k = 0; k < b->count && i < *num; k++) {
+                n = &b->nodes[k];
                 if(node_good(n)) {
-                    sin[i] = *(struct sockaddr_in*)&n->ss;
+                    address_to_sockaddr(&n->addr, (struct sockaddr*)&sin[i],
+                                        sizeof(struct sockaddr_in));
                     i++;
                 }
-                n = n->next;
             }
         }
         b = b->next;
@@ -2405,25 +4715,25 @@ dht_get_nodes(struct sockaddr_in *sin, int *num,
     if(b == NULL)
         goto no_ipv6;
 
-    n = b->nodes;
-    while(n && j < *num6) {
+    for(k = 0; k < b->count && j < *num6; k++) {
+        n = &b->nodes[k];
         if(node_good(n)) {
-            sin6[j] = *(struct sockaddr_in6*)&n->ss;
+            address_to_sockaddr(&n->addr, (struct sockaddr*)&sin6[j],
+                                sizeof(struct sockaddr_in6));
             j++;
         }
-        n = n->next;
     }
 
     b = buckets6;
     while(b && j < *num6) {
         if(!in_bucket(myid, b)) {
-            n = b->nodes;
-            while(n && j < *num6) {
+            for(k = 0; k < b->count && j < *num6; k++) {
+                n = &b->nodes[k];
                 if(node_good(n)) {
-                    sin6[j] = *(struct sockaddr_in6*)&n->ss;
+                    address_to_sockaddr(&n->addr, (struct sockaddr*)&sin6[j],
+                                        sizeof(struct sockaddr_in6));
                     j++;
                 }
-                n = n->next;
             }
         }
         b = b->next;
@@ -2440,13 +4750,19 @@ int
 dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen)
 {
     struct node *n;
+    struct address a;
 
     if(sa->sa_family != AF_INET && sa->sa_family != AF_INET6) {
         errno = EAFNOSUPPORT;
         return -1;
     }
 
-    n = new_node(id, sa, salen, 0);
+    if(sockaddr_to_address(sa, salen, &a) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    n = new_node(id, &a, 0);
     return !!n;
 }
 
@@ -2454,14 +4770,20 @@ int
 dht_ping_node(const struct sockaddr *sa, int salen)
 {
     unsigned char tid[4];
+    struct address a;
+
+    if(sockaddr_to_address(sa, salen, &a) < 0) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
 
     debugf("Sending ping.\n");
     make_tid(tid, "pn", 0);
-    return send_ping(sa, salen, tid, 4);
+    return send_ping(&a, tid, 4);
 }
 
-/* We could use a proper bencoding printer and parser, but the format of
-   DHT messages is fairly stylised, so this seemed simpler. */
+/* We could use a proper bencoding printer, but the format of DHT messages
+   is fairly stylised, so this seemed simpler. */
 
 #define CHECK(offset, delta, size)                      \
     if(delta < 0 || offset + delta > size) goto fail
@@ -2475,29 +4797,63 @@ dht_ping_node(const struct sockaddr *sa, int salen)
     memcpy(buf + offset, src, delta);                   \
     offset += delta;
 
-#define ADD_V(buf, offset, size)                        \
-    if(have_v) {                                        \
-        COPY(buf, offset, my_v, sizeof(my_v), size);    \
-    }
+#define COPY_STRING(buf, offset, string, size)          \
+    COPY(buf, offset, string, sizeof(string) - 1, size)
+
+/* A decimal number followed by a terminator, either ':' for the length
+   of a string or 'e' for an integer. */
+#define ADD_NUMBER(buf, offset, value, terminator, size)                \
+    rc = format_number(buf + offset, size - offset, value, terminator); \
+    INC(offset, rc, size)
+
+#define ADD_STRING(buf, offset, src, len, size)         \
+    ADD_NUMBER(buf, offset, len, ':', size);            \
+    COPY(buf, offset, src, len, size)
+
+/* The transaction id and our version, and the closing of the message. */
+#define ADD_TRAILER(buf, offset, tid, tid_len, trailer, size)   \
+    COPY_STRING(buf, offset, "1:t", size);                      \
+    ADD_STRING(buf, offset, tid, tid_len, size);                \
+    COPY(buf, offset, trailer, trailer_len, size)
+
+static int
+format_number(char *buf, int size, unsigned int value, char terminator)
+{
+    char digits[12];
+    int n = 0, i;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+
+    if(n + 1 > size)
+        return -1;
+
+    for(i = 0; i < n; i++)
+        buf[i] = digits[n - 1 - i];
+    buf[n] = terminator;
+    return n + 1;
+}
 
 static int
-dht_send(const void *buf, size_t len, int flags,
-         const struct sockaddr *sa, int salen)
+dht_send(const void *buf, size_t len, int flags, const struct address *a)
 {
-    int s;
+    struct sockaddr_storage ss;
+    int s, sslen;
 
-    if(salen == 0)
+    if(a->af == 0)
         abort();
 
-    if(node_blacklisted(sa, salen)) {
+    if(node_blacklisted(a)) {
         debugf("Attempting to send to blacklisted node.\n");
         errno = EPERM;
         return -1;
     }
 
-    if(sa->sa_family == AF_INET)
+    if(a->af == AF_INET)
         s = dht_socket;
-    else if(sa->sa_family == AF_INET6)
+    else if(a->af == AF_INET6)
         s = dht_socket6;
     else
         s = -1;
@@ -2507,23 +4863,20 @@ dht_send(const void *buf, size_t len, int flags,
         return -1;
     }
 
-    return dht_sendto(s, buf, len, flags, sa, salen);
+    sslen = address_to_sockaddr(a, (struct sockaddr*)&ss, sizeof(ss));
+    return dht_sendto(s, buf, len, flags, (struct sockaddr*)&ss, sslen);
 }
 
 int
-send_ping(const struct sockaddr *sa, int salen,
+send_ping(const struct address *a,
           const unsigned char *tid, int tid_len)
 {
     char buf[512];
     int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:q4:ping1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    COPY(buf, i, query_header, 32, 512);
+    COPY_STRING(buf, i, "e1:q4:ping", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, query_trailer, 512);
+    return dht_send(buf, i, 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2531,18 +4884,15 @@ send_ping(const struct sockaddr *sa, int salen,
 }
 
 int
-send_pong(const struct sockaddr *sa, int salen,
+send_pong(const struct address *a,
           const unsigned char *tid, int tid_len)
 {
     char buf[512];
     int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    COPY(buf, i, reply_header, 32, 512);
+    COPY_STRING(buf, i, "e", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, reply_trailer, 512);
+    return dht_send(buf, i, 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2550,28 +4900,28 @@ send_pong(const struct sockaddr *sa, int salen,
 }
 
 int
-send_find_node(const struct sockaddr *sa, int salen,
+send_find_node(const struct address *a,
                const unsigned char *tid, int tid_len,
                const unsigned char *target, int want, int confirm)
 {
     char buf[512];
     int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "6:target20:"); INC(i, rc, 512);
+    COPY(buf, i, query_header, 32, 512);
+    COPY_STRING(buf, i, "6:target20:", 512);
     COPY(buf, i, target, 20, 512);
     if(want > 0) {
-        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        INC(i, rc, 512);
-    }
-    rc = snprintf(buf + i, 512 - i, "e1:q9:find_node1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+        COPY_STRING(buf, i, "4:wantl", 512);
+        if((want & WANT4)) {
+            COPY_STRING(buf, i, "2:n4", 512);
+        }
+        if((want & WANT6)) {
+            COPY_STRING(buf, i, "2:n6", 512);
+        }
+        COPY_STRING(buf, i, "e", 512);
+    }
+    COPY_STRING(buf, i, "e1:q9:find_node", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, query_trailer, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2579,7 +4929,7 @@ send_find_node(const struct sockaddr *sa, int salen,
 }
 
 int
-send_nodes_peers(const struct sockaddr *sa, int salen,
+send_nodes_peers(const struct address *a,
                  const unsigned char *tid, int tid_len,
                  const unsigned char *nodes, int nodes_len,
                  const unsigned char *nodes6, int nodes6_len,
@@ -2587,58 +4937,48 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
                  const unsigned char *token, int token_len)
 {
     char buf[2048];
-    int i = 0, rc, j0, j, k, len;
+    int i = 0, rc, j, k, n, len;
+    struct peer_list *pl = NULL;
 
-    rc = snprintf(buf + i, 2048 - i, "d1:rd2:id20:"); INC(i, rc, 2048);
-    COPY(buf, i, myid, 20, 2048);
+    COPY(buf, i, reply_header, 32, 2048);
     if(nodes_len > 0) {
-        rc = snprintf(buf + i, 2048 - i, "5:nodes%d:", nodes_len);
-        INC(i, rc, 2048);
-        COPY(buf, i, nodes, nodes_len, 2048);
+        COPY_STRING(buf, i, "5:nodes", 2048);
+        ADD_STRING(buf, i, nodes, nodes_len, 2048);
     }
     if(nodes6_len > 0) {
-         rc = snprintf(buf + i, 2048 - i, "6:nodes6%d:", nodes6_len);
-         INC(i, rc, 2048);
-         COPY(buf, i, nodes6, nodes6_len, 2048);
+        COPY_STRING(buf, i, "6:nodes6", 2048);
+        ADD_STRING(buf, i, nodes6, nodes6_len, 2048);
     }
     if(token_len > 0) {
-        rc = snprintf(buf + i, 2048 - i, "5:token%d:", token_len);
-        INC(i, rc, 2048);
-        COPY(buf, i, token, token_len, 2048);
+        COPY_STRING(buf, i, "5:token", 2048);
+        ADD_STRING(buf, i, token, token_len, 2048);
+    }
+
+    if(st) {
+        pl = af == AF_INET ? &st->peers : &st->peers6;
+        len = af == AF_INET ? PEER_LEN : PEER6_LEN;
     }
 
-    if(st && st->numpeers > 0) {
+    if(pl && pl->numpeers > 0) {
         /* We treat the storage as a circular list, and serve a randomly
            chosen slice.  In order to make sure we fit within 1024 octets,
-           we limit ourselves to 50 peers. */
-
-        len = af == AF_INET ? 4 : 16;
-        j0 = random() % st->numpeers;
-        j = j0;
-        k = 0;
-
-        rc = snprintf(buf + i, 2048 - i, "6:valuesl"); INC(i, rc, 2048);
-        do {
-            if(st->peers[j].len == len) {
-                unsigned short swapped;
-                swapped = htons(st->peers[j].port);
-                rc = snprintf(buf + i, 2048 - i, "%d:", len + 2);
-                INC(i, rc, 2048);
-                COPY(buf, i, st->peers[j].ip, len, 2048);
-                COPY(buf, i, &swapped, 2, 2048);
-                k++;
-            }
-            j = (j + 1) % st->numpeers;
-        } while(j != j0 && k < 50);
-        rc = snprintf(buf + i, 2048 - i, "e"); INC(i, rc, 2048);
+           we limit ourselves to 50 peers.  The records are already
+           encoded, so this is at most two copies. */
+
+        j = random() % pl->numpeers;
+        k = MIN(pl->numpeers, 50);
+        n = MIN(k, pl->numpeers - j);
+
+        COPY_STRING(buf, i, "6:valuesl", 2048);
+        COPY(buf, i, pl->records + j * len, n * len, 2048);
+        COPY(buf, i, pl->records, (k - n) * len, 2048);
+        COPY_STRING(buf, i, "e", 2048);
     }
 
-    rc = snprintf(buf + i, 2048 - i, "e1:t%d:", tid_len); INC(i, rc, 2048);
-    COPY(buf, i, tid, tid_len, 2048);
-    ADD_V(buf, i, 2048);
-    rc = snprintf(buf + i, 2048 - i, "1:y1:re"); INC(i, rc, 2048);
+    COPY_STRING(buf, i, "e", 2048);
+    ADD_TRAILER(buf, i, tid, tid_len, reply_trailer, 2048);
 
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2647,21 +4987,22 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
 
 static int
 insert_closest_node(unsigned char *nodes, int numnodes,
-                    const unsigned char *id, struct node *n)
+                    const unsigned char *id,
+                    const unsigned char *nid, struct node *n)
 {
     int i, size;
 
-    if(n->ss.ss_family == AF_INET)
+    if(n->addr.af == AF_INET)
         size = 26;
-    else if(n->ss.ss_family == AF_INET6)
+    else if(n->addr.af == AF_INET6)
         size = 38;
     else
         abort();
 
     for(i = 0; i< numnodes; i++) {
-        if(id_cmp(n->id, nodes + size * i) == 0)
+        if(id_cmp(nid, nodes + size * i) == 0)
             return numnodes;
-        if(xorcmp(n->id, nodes + size * i, id) < 0)
+        if(xorcmp(nid, nodes + size * i, id) < 0)
             break;
     }
 
@@ -2675,19 +5016,9 @@ insert_closest_node(unsigned char *nodes, int numnodes,
         memmove(nodes + size * (i + 1), nodes + size * i,
                 size * (numnodes - i - 1));
 
-    if(n->ss.ss_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in*)&n->ss;
-        memcpy(nodes + size * i, n->id, 20);
-        memcpy(nodes + size * i + 20, &sin->sin_addr, 4);
-        memcpy(nodes + size * i + 24, &sin->sin_port, 2);
-    } else if(n->ss.ss_family == AF_INET6) {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&n->ss;
-        memcpy(nodes + size * i, n->id, 20);
-        memcpy(nodes + size * i + 20, &sin6->sin6_addr, 16);
-        memcpy(nodes + size * i + 36, &sin6->sin6_port, 2);
-    } else {
-        abort();
-    }
+    memcpy(nodes + size * i, nid, 20);
+    memcpy(nodes + size * i + 20, n->addr.ip, size - 22);
+    memcpy(nodes + size * i + size - 2, &n->addr.port, 2);
 
     return numnodes;
 }
@@ -2696,17 +5027,17 @@ static int
 buffer_closest_nodes(unsigned char *nodes, int numnodes,
                      const unsigned char *id, struct bucket *b)
 {
-    struct node *n = b->nodes;
-    while(n) {
-        if(node_good(n))
-            numnodes = insert_closest_node(nodes, numnodes, id, n);
-        n = n->next;
+    int i;
+    for(i = 0; i < b->count; i++) {
+        if(node_good(&b->nodes[i]))
+            numnodes = insert_closest_node(nodes, numnodes, id,
+                                           b->ids[i], &b->nodes[i]);
     }
     return numnodes;
 }
 
 int
-send_closest_nodes(const struct sockaddr *sa, int salen,
+send_closest_nodes(const struct address *a,
                    const unsigned char *tid, int tid_len,
                    const unsigned char *id, int want,
                    int af, struct storage *st,
@@ -2718,7 +5049,7 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
     struct bucket *b;
 
     if(want <= 0)
-        want = sa->sa_family == AF_INET ? WANT4 : WANT6;
+        want = a->af == AF_INET ? WANT4 : WANT6;
 
     if((want & WANT4)) {
         b = find_bucket(id, AF_INET);
@@ -2746,36 +5077,36 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
     }
     debugf("  (%d+%d nodes.)\n", numnodes, numnodes6);
 
-    return send_nodes_peers(sa, salen, tid, tid_len,
+    return send_nodes_peers(a, tid, tid_len,
                             nodes, numnodes * 26,
                             nodes6, numnodes6 * 38,
                             af, st, token, token_len);
 }
 
 int
-send_get_peers(const struct sockaddr *sa, int salen,
+send_get_peers(const struct address *a,
                unsigned char *tid, int tid_len, unsigned char *infohash,
                int want, int confirm)
 {
     char buf[512];
     int i = 0, rc;
 
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, query_header, 32, 512);
+    COPY_STRING(buf, i, "9:info_hash20:", 512);
     COPY(buf, i, infohash, 20, 512);
     if(want > 0) {
-        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        INC(i, rc, 512);
-    }
-    rc = snprintf(buf + i, 512 - i, "e1:q9:get_peers1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+        COPY_STRING(buf, i, "4:wantl", 512);
+        if((want & WANT4)) {
+            COPY_STRING(buf, i, "2:n4", 512);
+        }
+        if((want & WANT6)) {
+            COPY_STRING(buf, i, "2:n6", 512);
+        }
+        COPY_STRING(buf, i, "e", 512);
+    }
+    COPY_STRING(buf, i, "e1:q9:get_peers", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, query_trailer, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2783,7 +5114,7 @@ send_get_peers(const struct sockaddr *sa, int salen,
 }
 
 int
-send_announce_peer(const struct sockaddr *sa, int salen,
+send_announce_peer(const struct address *a,
                    unsigned char *tid, int tid_len,
                    unsigned char *infohash, unsigned short port,
                    unsigned char *token, int token_len, int confirm)
@@ -2791,21 +5122,17 @@ send_announce_peer(const struct sockaddr *sa, int salen,
     char buf[512];
     int i = 0, rc;
 
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, query_header, 32, 512);
+    COPY_STRING(buf, i, "9:info_hash20:", 512);
     COPY(buf, i, infohash, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "4:porti%ue5:token%d:", (unsigned)port,
-                  token_len);
-    INC(i, rc, 512);
-    COPY(buf, i, token, token_len, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:q13:announce_peer1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-
-    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen);
+    COPY_STRING(buf, i, "4:porti", 512);
+    ADD_NUMBER(buf, i, port, 'e', 512);
+    COPY_STRING(buf, i, "5:token", 512);
+    ADD_STRING(buf, i, token, token_len, 512);
+    COPY_STRING(buf, i, "e1:q13:announce_peer", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, query_trailer, 512);
+
+    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, a);
 
  fail:
     errno = ENOSPC;
@@ -2813,20 +5140,16 @@ send_announce_peer(const struct sockaddr *sa, int salen,
 }
 
 static int
-send_peer_announced(const struct sockaddr *sa, int salen,
-                    unsigned char *tid, int tid_len)
+send_peer_announced(const struct address *a,
+                    const unsigned char *tid, int tid_len)
 {
     char buf[512];
     int i = 0, rc;
 
-    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    COPY(buf, i, reply_header, 32, 512);
+    COPY_STRING(buf, i, "e", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, reply_trailer, 512);
+    return dht_send(buf, i, 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2834,22 +5157,20 @@ send_peer_announced(const struct sockaddr *sa, int salen,
 }
 
 static int
-send_error(const struct sockaddr *sa, int salen,
-           unsigned char *tid, int tid_len,
+send_error(const struct address *a,
+           const unsigned char *tid, int tid_len,
            int code, const char *message)
 {
     char buf[512];
     int i = 0, rc, message_len;
 
     message_len = strlen(message);
-    rc = snprintf(buf + i, 512 - i, "d1:eli%de%d:", code, message_len);
-    INC(i, rc, 512);
-    COPY(buf, i, message, message_len, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:ee"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    COPY_STRING(buf, i, "d1:eli", 512);
+    ADD_NUMBER(buf, i, code, 'e', 512);
+    ADD_STRING(buf, i, message, message_len, 512);
+    COPY_STRING(buf, i, "e", 512);
+    ADD_TRAILER(buf, i, tid, tid_len, error_trailer, 512);
+    return dht_send(buf, i, 0, a);
 
  fail:
     errno = ENOSPC;
@@ -2859,212 +5180,338 @@ send_error(const struct sockaddr *sa, int salen,
 #undef CHECK
 #undef INC
 #undef COPY
-#undef ADD_V
+#undef COPY_STRING
+#undef ADD_NUMBER
+#undef ADD_STRING
+#undef ADD_TRAILER
+
+/* A minimal bencoding parser.  Each of the functions below parses a single
+   value starting at p, and returns a pointer just after it, or NULL if the
+   value is malformed or extends beyond end. */
 
-#ifdef HAVE_MEMMEM
+/* The maximum depth of nested lists and dictionaries that we skip over. */
+#define PARSE_MAX_DEPTH 16
 
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
+static const unsigned char *
+parse_string(const unsigned char *p, const unsigned char *end,
+             const unsigned char **string_return, int *len_return)
 {
-    return memmem(haystack, haystacklen, needle, needlelen);
+    long l = 0;
+
+    if(p >= end || *p < '0' || *p > '9')
+        return NULL;
+
+    while(p < end && *p >= '0' && *p <= '9') {
+        l = l * 10 + (*p - '0');
+        if(l > end - p)
+            return NULL;
+        p++;
+    }
+
+    if(p >= end || *p != ':' || l > end - p - 1)
+        return NULL;
+
+    *string_return = p + 1;
+    *len_return = l;
+    return p + 1 + l;
 }
 
-#else
+static const unsigned char *
+parse_integer(const unsigned char *p, const unsigned char *end,
+              long *value_return)
+{
+    long l = 0;
+    int negative = 0;
 
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
+    if(p >= end || *p != 'i')
+        return NULL;
+    p++;
+
+    if(p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+
+    if(p >= end || *p < '0' || *p > '9')
+        return NULL;
+
+    while(p < end && *p >= '0' && *p <= '9') {
+        /* Saturate, we never care about large values. */
+        if(l < 0x10000000)
+            l = l * 10 + (*p - '0');
+        p++;
+    }
+
+    if(p >= end || *p != 'e')
+        return NULL;
+
+    *value_return = negative ? -l : l;
+    return p + 1;
+}
+
+static const unsigned char *
+skip_value(const unsigned char *p, const unsigned char *end, int depth)
 {
-    const char *h = haystack;
-    const char *n = needle;
-    size_t i;
+    const unsigned char *s;
+    int l;
+    long v;
 
-    /* size_t is unsigned */
-    if(needlelen > haystacklen)
+    if(p >= end)
         return NULL;
 
-    for(i = 0; i <= haystacklen - needlelen; i++) {
-        if(memcmp(h + i, n, needlelen) == 0)
-            return (void*)(h + i);
+    switch(*p) {
+    case 'i':
+        return parse_integer(p, end, &v);
+    case 'l':
+    case 'd':
+        if(depth >= PARSE_MAX_DEPTH)
+            return NULL;
+        p++;
+        while(p && p < end && *p != 'e')
+            p = skip_value(p, end, depth + 1);
+        if(p == NULL || p >= end)
+            return NULL;
+        return p + 1;
+    default:
+        return parse_string(p, end, &s, &l);
     }
-    return NULL;
 }
 
-#endif
+#define KEY_IS(key, key_len, name)                                      \
+    ((key_len) == sizeof(name) - 1 && memcmp((key), (name), (key_len)) == 0)
 
-static int
-parse_message(const unsigned char *buf, int buflen,
-              struct parsed_message *m)
+static const unsigned char *
+parse_values(const unsigned char *p, const unsigned char *end,
+             struct parsed_message *m)
 {
-    const unsigned char *p;
-
-    /* This code will happily crash if the buffer is not NUL-terminated. */
-    if(buf[buflen] != '\0') {
-        debugf("Eek!  parse_message with unterminated buffer.\n");
-        return -1;
+    const unsigned char *values;
+    int n = 0, n6 = 0;
+
+    if(p >= end || *p != 'l')
+        return skip_value(p, end, 1);
+    p++;
+    values = p;
+
+    while(p < end && *p != 'e') {
+        const unsigned char *s;
+        int l;
+        p = parse_string(p, end, &s, &l);
+        if(p == NULL)
+            return NULL;
+        if(l == 6)
+            n++;
+        else if(l == 18)
+            n6++;
+        else
+            debugf("Received weird value -- %d bytes.\n", l);
     }
 
+    if(p >= end)
+        return NULL;
 
-#define CHECK(ptr, len)                                                 \
-    if(((unsigned char*)ptr) + (len) > (buf) + (buflen)) goto overflow;
+    m->values = values;
+    m->values_len = p - values;
+    m->numvalues = n;
+    m->numvalues6 = n6;
+    return p + 1;
+}
 
-    p = dht_memmem(buf, buflen, "1:t", 3);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 3, &q, 10);
-        if(q && *q == ':' && l > 0 && l < PARSE_TID_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->tid, q + 1, l);
-            m->tid_len = l;
+/* Copy the values of length len (6 or 18) out of the list of values of
+   a parsed message into buf.  Returns the number of bytes copied. */
+static int
+extract_values(const struct parsed_message *m, int len,
+               unsigned char *buf, int buflen)
+{
+    const unsigned char *p = m->values, *end = m->values + m->values_len;
+    int i = 0;
+
+    while(p && p < end) {
+        const unsigned char *s;
+        int l;
+        p = parse_string(p, end, &s, &l);
+        if(p == NULL)
+            break;
+        if(l == len && i + l <= buflen) {
+            memcpy(buf + i, s, l);
+            i += l;
         }
     }
+    return i;
+}
 
-    p = dht_memmem(buf, buflen, "2:id20:", 7);
-    if(p) {
-        CHECK(p + 7, 20);
-        memcpy(m->id, p + 7, 20);
+static const unsigned char *
+parse_want(const unsigned char *p, const unsigned char *end,
+           struct parsed_message *m)
+{
+    if(p >= end || *p != 'l')
+        return skip_value(p, end, 1);
+    p++;
+
+    m->want = 0;
+    while(p < end && *p != 'e') {
+        const unsigned char *s;
+        int l;
+        p = parse_string(p, end, &s, &l);
+        if(p == NULL)
+            return NULL;
+        if(KEY_IS(s, l, "n4"))
+            m->want |= WANT4;
+        else if(KEY_IS(s, l, "n6"))
+            m->want |= WANT6;
+        else
+            debugf("eek... unexpected want flag (%d bytes)\n", l);
     }
 
-    p = dht_memmem(buf, buflen, "9:info_hash20:", 14);
-    if(p) {
-        CHECK(p + 14, 20);
-        memcpy(m->info_hash, p + 14, 20);
-    }
+    if(p >= end)
+        return NULL;
+    return p + 1;
+}
 
-    p = dht_memmem(buf, buflen, "4:porti", 7);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 7, &q, 10);
-        if(q && *q == 'e' && l > 0 && l < 0x10000)
-            m->port = l;
-    }
+/* Parse the arguments of a query or the body of a reply. */
+static const unsigned char *
+parse_arguments(const unsigned char *p, const unsigned char *end,
+                struct parsed_message *m)
+{
+    if(p >= end || *p != 'd')
+        return skip_value(p, end, 1);
+    p++;
 
-    p = dht_memmem(buf, buflen, "12:implied_porti", 16);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 16, &q, 10);
-        if(q && *q == 'e' && l > 0 && l < 0x10000)
-            m->implied_port = l;
-    }
+    while(p < end && *p != 'e') {
+        const unsigned char *key, *s;
+        int key_len, l;
+        long v;
 
-    p = dht_memmem(buf, buflen, "6:target20:", 11);
-    if(p) {
-        CHECK(p + 11, 20);
-        memcpy(m->target, p + 11, 20);
-    }
+        p = parse_string(p, end, &key, &key_len);
+        if(p == NULL)
+            return NULL;
 
-    p = dht_memmem(buf, buflen, "5:token", 7);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 7, &q, 10);
-        if(q && *q == ':' && l > 0 && l < PARSE_TOKEN_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->token, q + 1, l);
-            m->token_len = l;
+        if(KEY_IS(key, key_len, "id")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l == 20)
+                m->id = s;
+        } else if(KEY_IS(key, key_len, "info_hash")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l == 20)
+                m->info_hash = s;
+        } else if(KEY_IS(key, key_len, "target")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l == 20)
+                m->target = s;
+        } else if(KEY_IS(key, key_len, "port")) {
+            p = parse_integer(p, end, &v);
+            if(p && v > 0 && v < 0x10000)
+                m->port = v;
+        } else if(KEY_IS(key, key_len, "implied_port")) {
+            p = parse_integer(p, end, &v);
+            if(p && v > 0 && v < 0x10000)
+                m->implied_port = v;
+        } else if(KEY_IS(key, key_len, "token")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l > 0 && l < PARSE_TOKEN_LEN) {
+                m->token = s;
+                m->token_len = l;
+            }
+        } else if(KEY_IS(key, key_len, "nodes")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l > 0 && l <= PARSE_NODES_LEN) {
+                m->nodes = s;
+                m->nodes_len = l;
+            }
+        } else if(KEY_IS(key, key_len, "nodes6")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l > 0 && l <= PARSE_NODES6_LEN) {
+                m->nodes6 = s;
+                m->nodes6_len = l;
+            }
+        } else if(KEY_IS(key, key_len, "values")) {
+            p = parse_values(p, end, m);
+        } else if(KEY_IS(key, key_len, "want")) {
+            p = parse_want(p, end, m);
+        } else {
+            p = skip_value(p, end, 1);
         }
-    }
 
-    p = dht_memmem(buf, buflen, "5:nodes", 7);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 7, &q, 10);
-        if(q && *q == ':' && l > 0 && l <= PARSE_NODES_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->nodes, q + 1, l);
-            m->nodes_len = l;
-        }
+        if(p == NULL)
+            return NULL;
     }
 
-    p = dht_memmem(buf, buflen, "6:nodes6", 8);
-    if(p) {
-        long l;
-        char *q;
-        l = strtol((char*)p + 8, &q, 10);
-        if(q && *q == ':' && l > 0 && l <= PARSE_NODES6_LEN) {
-            CHECK(q + 1, l);
-            memcpy(m->nodes6, q + 1, l);
-            m->nodes6_len = l;
-        }
-    }
+    if(p >= end)
+        return NULL;
+    return p + 1;
+}
 
-    p = dht_memmem(buf, buflen, "6:valuesl", 9);
-    if(p) {
-        int i = p - buf + 9;
-        int j = 0, j6 = 0;
-        while(1) {
-            long l;
-            char *q;
-            l = strtol((char*)buf + i, &q, 10);
-            if(q && *q == ':' && l > 0) {
-                CHECK(q + 1, l);
-                i = q + 1 + l - (char*)buf;
-                if(l == 6) {
-                    if(j + l > PARSE_VALUES_LEN)
-                        continue;
-                    memcpy((char*)m->values + j, q + 1, l);
-                    j += l;
-                } else if(l == 18) {
-                    if(j6 + l > PARSE_VALUES6_LEN)
-                        continue;
-                    memcpy((char*)m->values6 + j6, q + 1, l);
-                    j6 += l;
-                } else {
-                    debugf("Received weird value -- %d bytes.\n", (int)l);
-                }
-            } else {
-                break;
+/* Parse a KRPC message in a single pass over the top-level dictionary.
+   Returns the message type, or -1 if the message is malformed. */
+static int
+parse_message(const unsigned char *buf, int buflen,
+              struct parsed_message *m)
+{
+    const unsigned char *p = buf, *end = buf + buflen;
+    const unsigned char *query = NULL;
+    int query_len = 0;
+    int type = 0;
+
+    if(p >= end || *p != 'd')
+        goto fail;
+    p++;
+
+    while(p < end && *p != 'e') {
+        const unsigned char *key, *s;
+        int key_len, l;
+
+        p = parse_string(p, end, &key, &key_len);
+        if(p == NULL)
+            goto fail;
+
+        if(KEY_IS(key, key_len, "t")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l > 0 && l < PARSE_TID_LEN) {
+                m->tid = s;
+                m->tid_len = l;
             }
+        } else if(KEY_IS(key, key_len, "y")) {
+            p = parse_string(p, end, &s, &l);
+            if(p && l == 1)
+                type = s[0];
+        } else if(KEY_IS(key, key_len, "q")) {
+            p = parse_string(p, end, &query, &query_len);
+        } else if(KEY_IS(key, key_len, "a") || KEY_IS(key, key_len, "r")) {
+            p = parse_arguments(p, end, m);
+        } else {
+            p = skip_value(p, end, 1);
         }
-        if(i >= buflen || buf[i] != 'e')
-            debugf("eek... unexpected end for values.\n");
-        m->values_len = j;
-        m->values6_len = j6;
-    }
-
-    p = dht_memmem(buf, buflen, "4:wantl", 7);
-    if(p) {
-        int i = p - buf + 7;
-        m->want = 0;
-        while(buf[i] > '0' && buf[i] <= '9' && buf[i + 1] == ':' &&
-              i + 2 + buf[i] - '0' < buflen) {
-            CHECK(buf + i + 2, buf[i] - '0');
-            if(buf[i] == '2' && memcmp(buf + i + 2, "n4", 2) == 0)
-                m->want |= WANT4;
-            else if(buf[i] == '2' && memcmp(buf + i + 2, "n6", 2) == 0)
-                m->want |= WANT6;
-            else
-                debugf("eek... unexpected want flag (%c)\n", buf[i]);
-            i += 2 + buf[i] - '0';
-        }
-        if(i >= buflen || buf[i] != 'e')
-            debugf("eek... unexpected end for want.\n");
+
+        if(p == NULL)
+            goto fail;
     }
 
-#undef CHECK
+    if(p >= end)
+        goto fail;
 
-    if(dht_memmem(buf, buflen, "1:y1:r", 6))
+    switch(type) {
+    case 'r':
         return REPLY;
-    if(dht_memmem(buf, buflen, "1:y1:e", 6))
+    case 'e':
         return ERROR;
-    if(!dht_memmem(buf, buflen, "1:y1:q", 6))
+    case 'q':
+        if(query == NULL)
+            return -1;
+        if(KEY_IS(query, query_len, "ping"))
+            return PING;
+        if(KEY_IS(query, query_len, "find_node"))
+            return FIND_NODE;
+        if(KEY_IS(query, query_len, "get_peers"))
+            return GET_PEERS;
+        if(KEY_IS(query, query_len, "announce_peer"))
+            return ANNOUNCE_PEER;
         return -1;
-    if(dht_memmem(buf, buflen, "1:q4:ping", 9))
-        return PING;
-    if(dht_memmem(buf, buflen, "1:q9:find_node", 14))
-       return FIND_NODE;
-    if(dht_memmem(buf, buflen, "1:q9:get_peers", 14))
-        return GET_PEERS;
-    if(dht_memmem(buf, buflen, "1:q13:announce_peer", 19))
-       return ANNOUNCE_PEER;
-    return -1;
+    default:
+        return -1;
+    }
 
- overflow:
-    debugf("Truncated message.\n");
+ fail:
+    debugf("Truncated or malformed message.\n");
     return -1;
 }
+
+#undef KEY_IS
@@ -35,23 +35,53 @@ dht_callback_t(void *closure, int event,
 #define DHT_EVENT_SEARCH_DONE 3
 #define DHT_EVENT_SEARCH_DONE6 4
 
+/* The reason passed with DHT_EVENT_SEARCH_DONE, as an int. */
+#define DHT_SEARCH_CONVERGED 1
+#define DHT_SEARCH_EXHAUSTED 2
+
+#define DHT_PARAM_SEARCH_WINDOW 1
+#define DHT_PARAM_SEARCH_WINDOW_MIN 2
+#define DHT_PARAM_SEARCH_WINDOW_MAX 3
+#define DHT_PARAM_SEARCH_STABLE_REPLIES 4
+#define DHT_PARAM_SEARCH_MAX_QUERIES 5
+#define DHT_PARAM_SEARCH_MAX_TIME 6
+#define DHT_PARAM_SEARCH_RATE 7
+#define DHT_PARAM_SEARCH_CONCURRENCY 8
+#define DHT_PARAM_CACHE_TTL 9
+#define DHT_PARAM_CACHE_REFRESH 10
+#define DHT_PARAM_ANNOUNCE_INTERVAL 11
+#define DHT_PARAM_ANNOUNCE_CONCURRENCY 12
+
 extern FILE *dht_debug;
 
 int dht_init(int s, int s6, const unsigned char *id, const unsigned char *v);
 int dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen);
 int dht_ping_node(const struct sockaddr *sa, int salen);
 int dht_periodic(const void *buf, size_t buflen,
-                 const struct sockaddr *from, int fromlen, time_t *tosleep,
+                 const struct sockaddr *from, int fromlen,
+                 struct timeval *tosleep,
                  dht_callback_t *callback, void *closure);
 int dht_search(const unsigned char *id, int port, int af,
                dht_callback_t *callback, void *closure);
+int dht_search_many(const unsigned char *ids, int count, int port, int af,
+                    dht_callback_t *callback, void * const *closures);
+int dht_announce(const unsigned char *id, int port, int af);
+int dht_unannounce(const unsigned char *id, int af);
 int dht_nodes(int af,
               int *good_return, int *dubious_return, int *cached_return,
               int *incoming_return);
+int dht_announce_stats(int *covered_return, int *failing_return,
+                       int *running_return);
+int dht_cache_stats(int *hits_return, int *misses_return,
+                    int *evictions_return);
+int dht_search_peers(const unsigned char *id, int af,
+                     int *peers_return, int *duplicates_return);
 void dht_dump_tables(FILE *f);
 int dht_get_nodes(struct sockaddr_in *sin, int *num,
                   struct sockaddr_in6 *sin6, int *num6);
 int dht_uninit(void);
+int dht_set_parameter(int parameter, int value);
+int dht_load_filter(const char *filename);
 
 /* This must be provided by the user. */
 int dht_sendto(int sockfd, const void *buf, int len, int flags,